@@ -0,0 +1,140 @@
+/* ============================================================================
+ * Counting Bloom filter.
+ *
+ * Used to answer "this key surely does not exist" without touching the
+ * database. Every key maps to BLOOM_HASHES counters: adding a key
+ * increments them, removing it decrements them, and a key may exist only
+ * if all its counters are non zero. Counters reaching 255 stick there
+ * forever, since after an overflow we no longer know how many keys share
+ * them: this can only create false positives, never false negatives.
+ *
+ * Lookups are lock free and may run while another thread is adding or
+ * removing keys: the caller must make sure that adds and removes are
+ * serialized (the KV store performs them holding the writer lock), and
+ * that a key is added before it becomes visible and removed only after it
+ * was deleted.
+ * ==========================================================================*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "xmalloc.h"
+
+/* FNV-1a, followed by the splitmix64 finalizer, since we derive all the
+ * counter positions from this single 64 bit hash. */
+static uint64_t bloomHash(const char *key) {
+    uint64_t h = 14695981039346656037ULL;
+    while(*key) {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27; h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+/* Fill 'pos' with the BLOOM_HASHES counter positions of 'key', using
+ * double hashing (Kirsch-Mitzenmacher). */
+static void bloomPositions(bloom *b, const char *key, uint64_t *pos) {
+    uint64_t h = bloomHash(key);
+    uint64_t h1 = h & 0xffffffff, h2 = (h >> 32) | 1;
+    for (int j = 0; j < BLOOM_HASHES; j++)
+        pos[j] = (h1 + j*h2) & b->mask;
+}
+
+/* Create a filter sized for 'expected' keys. The filter uses 32 counters
+ * per expected key (but at least BLOOM_MIN_COUNTERS), so that the false
+ * positive rate stays low even if the number of keys grows a few times
+ * after the filter is created: with 4 hashes it is around 0.02% with the
+ * expected number of keys, and 2.5% with four times as many. */
+bloom *bloomCreate(uint64_t expected) {
+    bloom *b = xmalloc(sizeof(*b));
+    uint64_t size = BLOOM_MIN_COUNTERS;
+    while(size < expected*32) size *= 2;
+    b->counters = xmalloc(size);
+    memset(b->counters,0,size);
+    b->mask = size-1;
+    b->items = 0;
+    b->negatives = b->maybes = b->false_positives = 0;
+    return b;
+}
+
+void bloomFree(bloom *b) {
+    if (b == NULL) return;
+    xfree(b->counters);
+    xfree(b);
+}
+
+void bloomAdd(bloom *b, const char *key) {
+    uint64_t pos[BLOOM_HASHES];
+    bloomPositions(b,key,pos);
+    for (int j = 0; j < BLOOM_HASHES; j++) {
+        uint8_t c = __atomic_load_n(b->counters+pos[j],__ATOMIC_RELAXED);
+        if (c != 255) __atomic_store_n(b->counters+pos[j],c+1,__ATOMIC_RELAXED);
+    }
+    b->items++;
+}
+
+void bloomRemove(bloom *b, const char *key) {
+    uint64_t pos[BLOOM_HASHES];
+    bloomPositions(b,key,pos);
+    for (int j = 0; j < BLOOM_HASHES; j++) {
+        uint8_t c = __atomic_load_n(b->counters+pos[j],__ATOMIC_RELAXED);
+        if (c != 0 && c != 255)
+            __atomic_store_n(b->counters+pos[j],c-1,__ATOMIC_RELAXED);
+    }
+    if (b->items) b->items--;
+}
+
+/* Like bloomMaybe(), but without updating the lookup statistics: for
+ * internal checks of the filter user, that are not lookups. */
+int bloomProbe(bloom *b, const char *key) {
+    uint64_t pos[BLOOM_HASHES];
+    bloomPositions(b,key,pos);
+    for (int j = 0; j < BLOOM_HASHES; j++) {
+        if (__atomic_load_n(b->counters+pos[j],__ATOMIC_RELAXED) == 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* Return 0 if the key surely was never added (or was removed), 1 if it
+ * may exist. */
+int bloomMaybe(bloom *b, const char *key) {
+    if (bloomProbe(b,key)) {
+        __atomic_fetch_add(&b->maybes,1,__ATOMIC_RELAXED);
+        return 1;
+    }
+    __atomic_fetch_add(&b->negatives,1,__ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Called by the user of the filter when a "maybe" answer turned out to
+ * be wrong, to track the false positive rate. */
+void bloomFalsePositive(bloom *b) {
+    __atomic_fetch_add(&b->false_positives,1,__ATOMIC_RELAXED);
+}
+
+/* Append the filter statistics to the 'info' SDS string, and return it.
+ * The false positive rate is the fraction of the keys not existing that
+ * the filter failed to report as such. */
+sds bloomInfo(bloom *b, sds info) {
+    uint64_t neg = __atomic_load_n(&b->negatives,__ATOMIC_RELAXED);
+    uint64_t maybe = __atomic_load_n(&b->maybes,__ATOMIC_RELAXED);
+    uint64_t fp = __atomic_load_n(&b->false_positives,__ATOMIC_RELAXED);
+    return sdscatprintf(info,
+        "bloom_counters:%llu\n"
+        "bloom_items:%llu\n"
+        "bloom_negatives:%llu\n"
+        "bloom_maybes:%llu\n"
+        "bloom_false_positives:%llu\n"
+        "bloom_fp_rate:%.4f\n",
+        (unsigned long long)b->mask+1,
+        (unsigned long long)b->items,
+        (unsigned long long)neg,
+        (unsigned long long)maybe,
+        (unsigned long long)fp,
+        neg+fp ? (double)fp/(neg+fp) : 0);
+}
@@ -0,0 +1,30 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdint.h>
+#include "sds.h"
+
+#define BLOOM_HASHES 4              /* Counters per key. */
+#define BLOOM_MIN_COUNTERS (1<<20)  /* Smallest filter: 1MB. */
+
+/* Counting Bloom filter: every key increments BLOOM_HASHES 8 bit
+ * counters, so keys can be removed as well. */
+typedef struct bloom {
+    uint8_t *counters;
+    uint64_t mask;              /* Number of counters minus one. */
+    uint64_t items;             /* Keys added minus keys removed. */
+    uint64_t negatives;         /* Lookups answered "not present". */
+    uint64_t maybes;            /* Lookups answered "maybe present". */
+    uint64_t false_positives;   /* "Maybe" answers that were wrong. */
+} bloom;
+
+bloom *bloomCreate(uint64_t expected);
+void bloomFree(bloom *b);
+void bloomAdd(bloom *b, const char *key);
+void bloomRemove(bloom *b, const char *key);
+int bloomMaybe(bloom *b, const char *key);
+int bloomProbe(bloom *b, const char *key);
+void bloomFalsePositive(bloom *b);
+sds bloomInfo(bloom *b, sds info);
+
+#endif
@@ -43,12 +43,14 @@
 #include <unistd.h>
 #include <math.h>
 #include <time.h>
+#include <signal.h>
 
 #include <curl/curl.h>
 #include <sqlite3.h>
 
 #include "sds.h"
 #include "cJSON.h"
+#include "memkv.h"
 #include "botlib.h"
 
 /* Thread local and atomic state. */
@@ -62,11 +64,21 @@ struct {
                           enabled with a few --debug calls. */
     int verbose;                        // If true enables verbose info.
     char *dbfile;                       // Change with --dbfile.
+    sqlPool **dbpools;                  // Connections pools, one per shard.
+    int numshards;                      // Number of shards, --shards.
+    size_t kvcache;                     // KV cache size, --kvcache.
+    size_t kvcompress;                  // Compression threshold, --kvcompress.
+    int kvbloom;                        // Keys Bloom filter, --kvbloom.
+    kvExpireState *kvexpire;            // Active expire state, per shard.
+    char *profile_file;                 // Queries profile, --profile.
+    char *memfile;                      // In memory KV snapshot, --memfile.
+    int64_t slowlog;                    // Slow log threshold, --slowlog.
     char **triggers;                    // Strings triggering processing.
     sds apikey;                         // Telegram API key for the bot.
     sds username;                       // Bot username from getMe call.
     TBRequestCallback req_callback;     // Callback handling requests.
     TBCronCallback cron_callback;
+    int flags;                          // TB_FLAGS_* passed to startBot().
 } Bot;
 
 /* Global stats. Sometimes we access such stats from threads without caring
@@ -76,8 +88,19 @@ struct {
 struct {
     time_t start_time;      /* Unix time the bot was started. */
     uint64_t queries;       /* Number of queries received. */
+    int snapshot_in_progress;   /* True while a snapshot is running. */
+    time_t snapshot_time;       /* Unix time of the last snapshot. */
+    int snapshot_ok;            /* True if the last snapshot succeeded. */
+    uint64_t snapshot_bytes;    /* Size of the last snapshot. */
+    uint64_t snapshot_us;       /* Duration of the last snapshot. */
 } botStats;
 
+/* Only one snapshot at a time can run. */
+static pthread_mutex_t SnapshotLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set by the signal handler when the bot should exit. */
+static volatile sig_atomic_t BotShutdown = 0;
+
 /* ============================================================================
  * Utils
  * ========================================================================= */
@@ -252,20 +275,25 @@ size_t makeHTTPGETCallWriterFILE(char *ptr, size_t size, size_t nmemb, void *use
 }
 
 
-/* Request the specified URL in a blocking way, returns the content (or
- * error string) as an SDS string. If 'resptr' is not NULL, the integer
- * will be set, by reference, to 1 or 0 to indicate success or error.
- * The returned SDS string must be freed by the caller both in case of
- * error and success. */
-sds makeHTTPGETCall(const char *url, int *resptr) {
-    if (Bot.debug) printf("HTTP GET %s\n", url);
+/* Implements makeHTTPGETCall() and makeHTTPPOSTJSONCall(): if 'json' is
+ * not NULL, it is sent as the body of a POST request. */
+static sds makeHTTPCall(const char *url, int *resptr, sds json) {
+    if (Bot.debug) printf("HTTP %s %s\n", json ? "POST" : "GET", url);
     CURL* curl;
     CURLcode res;
+    struct curl_slist *headers = NULL;
     sds body = sdsempty();
 
     curl = curl_easy_init();
     if (curl) {
         curl_easy_setopt(curl, CURLOPT_URL, url);
+        if (json) {
+            headers = curl_slist_append(headers,
+                "Content-Type: application/json");
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json);
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)sdslen(json));
+        }
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, makeHTTPGETCallWriterSDS);
         curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
         curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
@@ -290,10 +318,28 @@ sds makeHTTPGETCall(const char *url, int *resptr) {
 
         /* always cleanup */
         curl_easy_cleanup(curl);
+        curl_slist_free_all(headers);
     }
     return body;
 }
 
+/* Request the specified URL in a blocking way, returns the content (or
+ * error string) as an SDS string. If 'resptr' is not NULL, the integer
+ * will be set, by reference, to 1 or 0 to indicate success or error.
+ * The returned SDS string must be freed by the caller both in case of
+ * error and success. */
+sds makeHTTPGETCall(const char *url, int *resptr) {
+    return makeHTTPCall(url,resptr,NULL);
+}
+
+/* Like makeHTTPGETCall(), but POST the 'json' string as the request body,
+ * with the application/json content type. Unlike the query string of a
+ * GET request, the body needs no URL encoding, and its size is not
+ * limited by the maximum URL length. */
+sds makeHTTPPOSTJSONCall(const char *url, int *resptr, sds json) {
+    return makeHTTPCall(url,resptr,json);
+}
+
 /* Like makeHTTPGETCall(), but the list of options will be concatenated to
  * the URL as a query string, and URL encoded as needed.
  * The option list array should contain optnum*2 strings, alternating
@@ -332,6 +378,18 @@ sds makeGETBotRequest(const char *action, int *resptr, char **optlist, int numop
     return body;
 }
 
+/* Like makeGETBotRequest(), but the parameters of the action are sent
+ * as a JSON object, usually built with the jsonWriter API. */
+sds makeJSONBotRequest(const char *action, int *resptr, sds json) {
+    sds url = sdsnew("https://api.telegram.org/bot");
+    url = sdscat(url,Bot.apikey);
+    url = sdscatlen(url,"/",1);
+    url = sdscat(url,action);
+    sds body = makeHTTPPOSTJSONCall(url,resptr,json);
+    sdsfree(url);
+    return body;
+}
+
 /* Send an image using the sendPhoto endpoint. Return 1 on success, 0
  * on error. */
 int botSendImage(int64_t target, char *filename) {
@@ -394,6 +452,119 @@ int botSendImage(int64_t target, char *filename) {
     return retval;
 }
 
+/* =============================================================================
+ * JSON selectors used to parse the Telegram API replies.
+ * ===========================================================================*/
+
+/* The selectors are compiled once, the first time they are needed, since
+ * they are evaluated for every update received. The fields of updates,
+ * messages and entities are extracted with a single traversal of the
+ * object via cJSON_SelectManyCompiled(). */
+enum {
+    SEL_RESULT,
+    SEL_RESULT_USERNAME,
+    SEL_RESULT_MESSAGE_ID,
+    SEL_RESULT_CHAT_ID,
+    SEL_RESULT_FILE_PATH,
+    SEL_COUNT
+};
+
+static const char *BotSelectorPaths[SEL_COUNT] = {
+    [SEL_RESULT] = ".result:a",
+    [SEL_RESULT_USERNAME] = ".result.username:s",
+    [SEL_RESULT_MESSAGE_ID] = ".result.message_id:n",
+    [SEL_RESULT_CHAT_ID] = ".result.chat.id:n",
+    [SEL_RESULT_FILE_PATH] = ".result.file_path:s",
+};
+
+enum {
+    UPD_UPDATE_ID,
+    UPD_MESSAGE,
+    UPD_CHANNEL_POST,
+    UPD_COUNT
+};
+
+static const char *BotUpdatePaths[UPD_COUNT] = {
+    [UPD_UPDATE_ID] = ".update_id:n",
+    [UPD_MESSAGE] = ".message",
+    [UPD_CHANNEL_POST] = ".channel_post",
+};
+
+enum {
+    MSG_CHAT_ID,
+    MSG_CHAT_TYPE,
+    MSG_FROM_ID,
+    MSG_FROM_USERNAME,
+    MSG_MESSAGE_ID,
+    MSG_DATE,
+    MSG_TEXT,
+    MSG_VOICE_FILE_ID,
+    MSG_VOICE_FILE_SIZE,
+    MSG_ENTITIES,
+    MSG_COUNT
+};
+
+static const char *BotMessagePaths[MSG_COUNT] = {
+    [MSG_CHAT_ID] = ".chat.id:n",
+    [MSG_CHAT_TYPE] = ".chat.type:s",
+    [MSG_FROM_ID] = ".from.id:n",
+    [MSG_FROM_USERNAME] = ".from.username:s",
+    [MSG_MESSAGE_ID] = ".message_id:n",
+    [MSG_DATE] = ".date:n",
+    [MSG_TEXT] = ".text:s",
+    [MSG_VOICE_FILE_ID] = ".voice.file_id:s",
+    [MSG_VOICE_FILE_SIZE] = ".voice.file_size:n",
+    [MSG_ENTITIES] = ".entities:a",
+};
+
+enum {
+    ENT_TYPE,
+    ENT_OFFSET,
+    ENT_LENGTH,
+    ENT_COUNT
+};
+
+static const char *BotEntityPaths[ENT_COUNT] = {
+    [ENT_TYPE] = ".type:s",
+    [ENT_OFFSET] = ".offset:n",
+    [ENT_LENGTH] = ".length:n",
+};
+
+static cJSON_Selector *BotSelectors[SEL_COUNT];
+static cJSON_MultiSelector *BotUpdateSelector;
+static cJSON_MultiSelector *BotMessageSelector;
+static cJSON_MultiSelector *BotEntitySelector;
+static pthread_once_t BotSelectorsOnce = PTHREAD_ONCE_INIT;
+
+static void botCompileSelectors(void) {
+    for (int j = 0; j < SEL_COUNT; j++) {
+        BotSelectors[j] = cJSON_SelectCompile(BotSelectorPaths[j]);
+        if (BotSelectors[j] == NULL) {
+            printf("Invalid JSON selector: %s\n", BotSelectorPaths[j]);
+            exit(1);
+        }
+    }
+    BotUpdateSelector = cJSON_SelectManyCompile(BotUpdatePaths,UPD_COUNT);
+    BotMessageSelector = cJSON_SelectManyCompile(BotMessagePaths,MSG_COUNT);
+    BotEntitySelector = cJSON_SelectManyCompile(BotEntityPaths,ENT_COUNT);
+    if (!BotUpdateSelector || !BotMessageSelector || !BotEntitySelector) {
+        printf("Out of memory compiling the JSON selectors\n");
+        exit(1);
+    }
+}
+
+/* Evaluate the compiled selector 'id' against the object 'o'. */
+static cJSON *botSelect(cJSON *o, int id) {
+    pthread_once(&BotSelectorsOnce,botCompileSelectors);
+    return cJSON_SelectCompiled(o,BotSelectors[id]);
+}
+
+/* Fill 'out' with the fields selected by the multi selector 'ms'. */
+static void botSelectMany(cJSON *o, cJSON_MultiSelector **ms, cJSON **out) {
+    pthread_once(&BotSelectorsOnce,botCompileSelectors);
+    cJSON_SelectManyCompiled(o,*ms,out);
+}
+
 /* =============================================================================
  * Higher level Telegram bot API.
  * ===========================================================================*/
@@ -407,7 +578,7 @@ char *botGetUsername(void) {
     if (res == 0) return NULL;
 
     cJSON *json = cJSON_Parse(body), *username;
-    username = cJSON_Select(json,".result.username:s");
+    username = botSelect(json,SEL_RESULT_USERNAME);
     if (username) Bot.username = sdsnew(username->valuestring);
     sdsfree(body);
     cJSON_Delete(json);
@@ -418,39 +589,38 @@ char *botGetUsername(void) {
  * specific message (if reply_to is non zero).
  * Return 1 on success, 0 on error. */
 int botSendMessageAndGetInfo(int64_t target, sds text, int64_t reply_to, int64_t *chat_id, int64_t *message_id) {
-    char *options[10];
-    int optlen = 4;
-    options[0] = "chat_id";
-    options[1] = sdsfromlonglong(target);
-    options[2] = "text";
-    options[3] = text;
-    options[4] = "parse_mode";
-    options[5] = "Markdown";
-    options[6] = "disable_web_page_preview";
-    options[7] = "true";
+    jsonWriter w;
+    jsonWriterInit(&w,NULL);
+    jsonWriterObjectStart(&w);
+    jsonWriterKey(&w,"chat_id");
+    jsonWriterInt(&w,target);
+    jsonWriterKey(&w,"text");
+    jsonWriterStringLen(&w,text,sdslen(text));
+    jsonWriterKey(&w,"parse_mode");
+    jsonWriterString(&w,"Markdown");
+    jsonWriterKey(&w,"disable_web_page_preview");
+    jsonWriterBool(&w,1);
     if (reply_to) {
-        optlen++;
-        options[8] = "reply_to_message_id";
-        options[9] = sdsfromlonglong(reply_to);
-    } else {
-        options[9] = NULL; /* So we can sdsfree it later without problems. */
+        jsonWriterKey(&w,"reply_to_message_id");
+        jsonWriterInt(&w,reply_to);
     }
+    jsonWriterObjectEnd(&w);
+    sds params = jsonWriterDone(&w);
 
     int res;
-    sds body = makeGETBotRequest("sendMessage",&res,options,optlen);
+    sds body = makeJSONBotRequest("sendMessage",&res,params);
+    sdsfree(params);
 
     if (chat_id || message_id) {
         cJSON *json = cJSON_Parse(body), *res;
-        res = cJSON_Select(json,".result.message_id:n");
-        if (res && message_id) *message_id = (int64_t) res->valuedouble;
-        res = cJSON_Select(json,".result.chat.id:n");
-        if (res && chat_id) *chat_id = (int64_t) res->valuedouble;
+        res = botSelect(json,SEL_RESULT_MESSAGE_ID);
+        if (res && message_id) *message_id = cJSON_GetInt64(res);
+        res = botSelect(json,SEL_RESULT_CHAT_ID);
+        if (res && chat_id) *chat_id = cJSON_GetInt64(res);
         cJSON_Delete(json);
     }
 
     sdsfree(body);
-    sdsfree(options[1]);
-    sdsfree(options[9]);
     return res;
 }
 
@@ -466,24 +636,26 @@ int botSendMessage(int64_t target, sds text, int64_t reply_to) {
  * specific message (if reply_to is non zero).
  * Return 1 on success, 0 on error. */
 int botEditMessageText(int64_t chat_id, int message_id, sds text) {
-    char *options[10];
-    int optlen = 5;
-    options[0] = "chat_id";
-    options[1] = sdsfromlonglong(chat_id);
-    options[2] = "message_id";
-    options[3] = sdsfromlonglong(message_id);
-    options[4] = "text";
-    options[5] = text;
-    options[6] = "parse_mode";
-    options[7] = "Markdown";
-    options[8] = "disable_web_page_preview";
-    options[9] = "true";
+    jsonWriter w;
+    jsonWriterInit(&w,NULL);
+    jsonWriterObjectStart(&w);
+    jsonWriterKey(&w,"chat_id");
+    jsonWriterInt(&w,chat_id);
+    jsonWriterKey(&w,"message_id");
+    jsonWriterInt(&w,message_id);
+    jsonWriterKey(&w,"text");
+    jsonWriterStringLen(&w,text,sdslen(text));
+    jsonWriterKey(&w,"parse_mode");
+    jsonWriterString(&w,"Markdown");
+    jsonWriterKey(&w,"disable_web_page_preview");
+    jsonWriterBool(&w,1);
+    jsonWriterObjectEnd(&w);
+    sds params = jsonWriterDone(&w);
 
     int res;
-    sds body = makeGETBotRequest("editMessageText",&res,options,optlen);
+    sds body = makeJSONBotRequest("editMessageText",&res,params);
+    sdsfree(params);
     sdsfree(body);
-    sdsfree(options[1]);
-    sdsfree(options[3]);
     return res;
 }
 
@@ -510,7 +682,7 @@ int botGetFile(BotRequest *br, const char *target_filename) {
     }
 
     cJSON *json = cJSON_Parse(body);
-    cJSON *result = cJSON_Select(json,".result.file_path:s");
+    cJSON *result = botSelect(json,SEL_RESULT_FILE_PATH);
     char *file_path = result ? result->valuestring : NULL;
     sdsfree(body);
     if (!file_path) return 0; // Error.
@@ -582,9 +754,70 @@ BotRequest *createBotRequest(void) {
  * Database abstraction
  * ===========================================================================*/
 
+/* Return the file name of the specified shard: the "%d" in the --dbfile
+ * pattern is replaced by the shard number. Without sharding the file
+ * name is returned as it is. The returned SDS string should be freed
+ * by the caller. */
+sds dbShardFilename(int shard) {
+    sds fn = sdsnew(Bot.dbfile);
+    char *p = strstr(fn,"%d");
+    if (Bot.numshards <= 1 || p == NULL) return fn;
+    sds res = sdsnewlen(fn,p-fn);
+    res = sdscatprintf(res,"%d",shard);
+    res = sdscat(res,p+2);
+    sdsfree(fn);
+    return res;
+}
+
+/* Return the shard holding the data of the specified chat. Every shard
+ * holds a range of the hash values of the target IDs. */
+int botShardForTarget(int64_t target) {
+    if (Bot.numshards <= 1) return 0;
+    /* Mix the bits (splitmix64 finalizer), since IDs are not random. */
+    uint64_t h = target;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h = h ^ (h >> 31);
+    return (int)(((h >> 32) * (uint64_t)Bot.numshards) >> 32);
+}
+
+/* Return the number of database shards. */
+int botNumShards(void) {
+    return Bot.numshards;
+}
+
+/* Return the write connection of the specified shard. It is shared by
+ * all the threads, so it is mainly useful for the main thread (cron).
+ * Return NULL if the connections pool is disabled. */
+sqlite3 *botShardHandle(int shard) {
+    if (Bot.dbpools == NULL || shard < 0 || shard >= Bot.numshards)
+        return NULL;
+    return Bot.dbpools[shard]->writer;
+}
+
 /* Create the SQLite tables if needed (if createdb is true), and return
- * the SQLite database handle. Return NULL on error. */
+ * the SQLite database handle. Return NULL on error.
+ *
+ * This is called once at startup: if the connections pool is enabled, a
+ * pool for each shard is created, and the write connection of the first
+ * shard is returned. Request threads use dbOpenShard() instead. */
 sqlite3 *dbInit(char *createdb_query) {
+    if (!(Bot.flags & TB_FLAGS_NO_DB_POOL)) {
+        Bot.dbpools = xmalloc(sizeof(sqlPool*)*Bot.numshards);
+        for (int j = 0; j < Bot.numshards; j++) {
+            sds fn = dbShardFilename(j);
+            Bot.dbpools[j] = sqlPoolCreate(fn,createdb_query);
+            sdsfree(fn);
+            if (Bot.dbpools[j] == NULL) return NULL;
+            /* Every shard gets its share of the cache memory. */
+            if (Bot.kvcache)
+                Bot.dbpools[j]->kvcache =
+                    memkvCreate(Bot.kvcache/Bot.numshards);
+            if (Bot.kvbloom) kvBloomEnable(Bot.dbpools[j]->writer);
+        }
+        return Bot.dbpools[0]->writer;
+    }
+
     sqlite3 *db;
     int rt = sqlite3_open(Bot.dbfile, &db);
     if (rt != SQLITE_OK) {
@@ -592,6 +825,7 @@ sqlite3 *dbInit(char *createdb_query) {
         sqlite3_close(db);
         return NULL;
     }
+    sqlProfileAttach(db);
 
     if (createdb_query) {
         char *errmsg;
@@ -606,21 +840,159 @@ sqlite3 *dbInit(char *createdb_query) {
     return db;
 }
 
+/* Return a connection for the specified shard: a read only connection
+ * from the shard pool, or a new read-write connection if the pool is
+ * disabled (in such case there is a single shard). The connection must
+ * be released with dbRelease(). */
+sqlite3 *dbOpenShard(int shard) {
+    if (Bot.dbpools) return sqlPoolGetReader(Bot.dbpools[shard]);
+    return dbInit(NULL);
+}
+
+/* Release a connection obtained with dbOpenShard(). */
+void dbRelease(sqlite3 *db) {
+    if (db == NULL) return;
+    sqlPool *pool = Bot.dbpools ? sqlPoolOf(db) : NULL;
+    if (pool)
+        sqlPoolReleaseReader(pool,db);
+    else
+        sqlite3_close(db);
+}
+
+/* Call 'fn' for each shard, passing a read only connection of the shard
+ * (writes are routed to the shard writer as usual). This is what cron
+ * jobs should use in order to scan data across all the shards. */
+void botForEachShard(void (*fn)(sqlite3 *dbhandle, int shard, void *privdata), void *privdata) {
+    for (int j = 0; j < Bot.numshards; j++) {
+        sqlite3 *db = dbOpenShard(j);
+        if (db == NULL) continue;
+        fn(db,j,privdata);
+        dbRelease(db);
+    }
+}
+
 /* Should be called every time a thread exits, so that if the thread has
- * an SQLite thread-local handle, it gets closed. */
+ * an SQLite thread-local handle, it gets closed (or returned to the
+ * pool). */
 void dbClose(void) {
-    if (DbHandle) sqlite3_close(DbHandle);
+    dbRelease(DbHandle);
     DbHandle = NULL;
 }
 
+/* Pages copied at every backup step, and pause between steps. With the
+ * default page size this means 256kb every 10 milliseconds, a pace that
+ * keeps the impact on the requests latency negligible. */
+#define SNAPSHOT_STEP_PAGES 64
+#define SNAPSHOT_STEP_SLEEP_MS 10
+
+/* Background thread performing the snapshot started by botSnapshot(). */
+void *botSnapshotThread(void *arg) {
+    sds dest = arg;
+    sqlBackupStats st;
+    uint64_t bytes = 0, us = 0;
+    int ok = 1;
+
+    for (int j = 0; j < Bot.numshards; j++) {
+        sds src = dbShardFilename(j);
+        sds dst = sdsdup(dest);
+        char *p = strstr(dst,"%d");
+        if (Bot.numshards > 1) {
+            /* Name the shard copies like the shards themselves. */
+            sds fn = p ? sdsnewlen(dst,p-dst) : sdsdup(dst);
+            fn = sdscatprintf(fn,p ? "%d%s" : ".%d",j,p ? p+2 : "");
+            sdsfree(dst);
+            dst = fn;
+        }
+        if (sqlBackup(src,dst,SNAPSHOT_STEP_PAGES,SNAPSHOT_STEP_SLEEP_MS,
+                      &st) != SQLITE_OK)
+        {
+            printf("Snapshot of %s to %s failed\n", src, dst);
+            ok = 0;
+        }
+        bytes += st.bytes;
+        us += st.duration_us;
+        sdsfree(src);
+        sdsfree(dst);
+    }
+
+    if (Bot.verbose) printf("Snapshot completed: %llu bytes in %.3f sec "
+                            "(%.2f MB/sec)\n",
+                            (unsigned long long)bytes, (double)us/1000000,
+                            us ? (double)bytes/us : 0);
+    pthread_mutex_lock(&SnapshotLock);
+    botStats.snapshot_time = time(NULL);
+    botStats.snapshot_ok = ok;
+    botStats.snapshot_bytes = bytes;
+    botStats.snapshot_us = us;
+    botStats.snapshot_in_progress = 0;
+    pthread_mutex_unlock(&SnapshotLock);
+    sdsfree(dest);
+    return NULL;
+}
+
+/* Start a snapshot of the bot database into the file 'dest', using the
+ * SQLite online backup API in a background thread, so that the bot
+ * continues to serve requests while the copy is performed. When sharding
+ * is enabled, 'dest' can contain "%d" like --dbfile, otherwise the shard
+ * number is appended to the file name. This can be called from cron or
+ * from an admin command handler.
+ *
+ * Return 1 if the snapshot was started, or 0 if another snapshot is
+ * already in progress or the thread can't be created. Use
+ * botGetSnapshotInfo() to check the outcome. */
+int botSnapshot(const char *dest) {
+    pthread_mutex_lock(&SnapshotLock);
+    if (botStats.snapshot_in_progress) {
+        pthread_mutex_unlock(&SnapshotLock);
+        return 0;
+    }
+    botStats.snapshot_in_progress = 1;
+    pthread_mutex_unlock(&SnapshotLock);
+
+    pthread_t tid;
+    sds arg = sdsnew(dest);
+    if (pthread_create(&tid,NULL,botSnapshotThread,arg) != 0) {
+        sdsfree(arg);
+        pthread_mutex_lock(&SnapshotLock);
+        botStats.snapshot_in_progress = 0;
+        pthread_mutex_unlock(&SnapshotLock);
+        return 0;
+    }
+    pthread_detach(tid);
+    return 1;
+}
+
+/* Return an SDS string describing the state of the last snapshot,
+ * including the copy throughput. The caller should free the string. */
+sds botGetSnapshotInfo(void) {
+    pthread_mutex_lock(&SnapshotLock);
+    sds info = sdscatprintf(sdsempty(),
+        "snapshot_in_progress:%d\n"
+        "snapshot_last_time:%lld\n"
+        "snapshot_last_status:%s\n"
+        "snapshot_last_bytes:%llu\n"
+        "snapshot_last_duration_ms:%llu\n"
+        "snapshot_last_mb_per_sec:%.2f\n",
+        botStats.snapshot_in_progress,
+        (long long)botStats.snapshot_time,
+        botStats.snapshot_time == 0 ? "none" :
+            (botStats.snapshot_ok ? "ok" : "err"),
+        (unsigned long long)botStats.snapshot_bytes,
+        (unsigned long long)botStats.snapshot_us/1000,
+        botStats.snapshot_us ?
+            (double)botStats.snapshot_bytes/botStats.snapshot_us : 0);
+    pthread_mutex_unlock(&SnapshotLock);
+    return info;
+}
+
 /* =============================================================================
  * Bot requests handling
  * ========================================================================== */
 
 /* Request handling thread entry point. */
 void *botHandleRequest(void *arg) {
-    DbHandle = dbInit(NULL);
     BotRequest *br = arg;
+    DbHandle = dbOpenShard(botShardForTarget(br->target));
 
     /* Parse the request as a command composed of arguments. */
     br->argv = sdssplitargs(br->request,&br->argc);
@@ -655,40 +1027,54 @@ int64_t botProcessUpdates(int64_t offset, int timeout) {
     if (Bot.debug >= 2)
         printf("RECEIVED FROM TELEGRAM API:\n%s\n",body);
 
-    /* Parse the JSON in order to extract the message info. */
-    cJSON *json = cJSON_Parse(body);
-    cJSON *result = cJSON_Select(json,".result:a");
+    /* Parse the JSON in order to extract the message info. This function
+     * is only called by the main thread, and everything we need from the
+     * reply is copied into the BotRequest structures, so the tree is
+     * allocated into an arena that is reset and reused at every call.
+     * The parsing is lazy: the selectors below only expand the objects on
+     * the path to the fields we read, so things like reply_to_message or
+     * the photo sizes arrays are skipped without being parsed. */
+    static cJSON_Arena *arena = NULL;
+    if (arena == NULL) arena = cJSON_ArenaCreate(0);
+    cJSON *json = arena ?
+        cJSON_ParseLazy(arena,body,body ? sdslen(body) : 0) :
+        cJSON_Parse(body);
+    cJSON *result = botSelect(json,SEL_RESULT);
     if (result == NULL) goto fmterr;
     /* Process the array of updates. */
     cJSON *update;
     cJSON_ArrayForEach(update,result) {
-        cJSON *update_id = cJSON_Select(update,".update_id:n");
-        if (update_id == NULL) continue;
-        int64_t thisoff = (int64_t) update_id->valuedouble;
+        cJSON *uf[UPD_COUNT], *mf[MSG_COUNT];
+        botSelectMany(update,&BotUpdateSelector,uf);
+        if (uf[UPD_UPDATE_ID] == NULL) continue;
+        int64_t thisoff = cJSON_GetInt64(uf[UPD_UPDATE_ID]);
         if (thisoff > offset) offset = thisoff;
 
         /* The actual message may be stored in .message or .channel_post
          * depending on the fact this is a private or group message,
          * or, instead, a channel post. */
-        cJSON *msg = cJSON_Select(update,".message");
-        if (!msg) msg = cJSON_Select(update,".channel_post");
+        cJSON *msg = uf[UPD_MESSAGE];
+        if (!msg) msg = uf[UPD_CHANNEL_POST];
         if (!msg) continue;
 
-        cJSON *chatid = cJSON_Select(msg,".chat.id:n");
+        /* Extract all the fields we need with a single pass. */
+        botSelectMany(msg,&BotMessageSelector,mf);
+
+        cJSON *chatid = mf[MSG_CHAT_ID];
         if (chatid == NULL) continue;
-        int64_t target = (int64_t) chatid->valuedouble;
+        int64_t target = cJSON_GetInt64(chatid);
 
-        cJSON *fromid = cJSON_Select(msg,".from.id:n");
-        int64_t from = fromid ? (int64_t) fromid->valuedouble : 0;
+        cJSON *fromid = mf[MSG_FROM_ID];
+        int64_t from = cJSON_GetInt64(fromid);
 
-        cJSON *fromuser = cJSON_Select(msg,".from.username:s");
+        cJSON *fromuser = mf[MSG_FROM_USERNAME];
         char *from_username = fromuser ? fromuser->valuestring : "unknown";
 
-        cJSON *msgid = cJSON_Select(msg,".message_id:n");
-        int64_t message_id = msgid ? (int64_t) msgid->valuedouble : 0;
+        cJSON *msgid = mf[MSG_MESSAGE_ID];
+        int64_t message_id = cJSON_GetInt64(msgid);
 
-        cJSON *chattype = cJSON_Select(msg,".chat.type:s");
-        char *ct = chattype->valuestring;
+        cJSON *chattype = mf[MSG_CHAT_TYPE];
+        char *ct = chattype ? chattype->valuestring : NULL;
         int type = TB_TYPE_UNKNOWN;
         if (ct != NULL) {
             if (!strcmp(ct,"private")) type = TB_TYPE_PRIVATE;
@@ -697,10 +1083,10 @@ int64_t botProcessUpdates(int64_t offset, int timeout) {
             else if (!strcmp(ct,"channel")) type = TB_TYPE_CHANNEL;
         }
 
-        cJSON *date = cJSON_Select(msg,".date:n");
+        cJSON *date = mf[MSG_DATE];
         if (date == NULL) continue;
-        time_t timestamp = date->valuedouble;
-        cJSON *text = cJSON_Select(msg,".text:s");
+        time_t timestamp = cJSON_GetInt64(date);
+        cJSON *text = mf[MSG_TEXT];
         /* Text may be NULL even if the message is valid but
          * is a voice message, image, ... .*/
 
@@ -734,35 +1120,39 @@ int64_t botProcessUpdates(int64_t offset, int timeout) {
         br->from_username = sdsnew(from_username);
 
         /* Check for files. */
-        cJSON *voice = cJSON_Select(msg,".voice.file_id:s");
+        cJSON *voice = mf[MSG_VOICE_FILE_ID];
         if (voice) {
             br->file_type = TB_FILE_TYPE_VOICE_OGG;
-            br->file_id = voice->valuestring;
-            cJSON *size = cJSON_Select(msg,".voice.file_size:n");
-            br->file_size = size ? size->valuedouble : 0;
+            br->file_id = sdsnew(voice->valuestring);
+            cJSON *size = mf[MSG_VOICE_FILE_SIZE];
+            br->file_size = cJSON_GetInt64(size);
         }
 
         /* Parse entities, filling the mentions array. */
-        cJSON *entities = cJSON_Select(msg,".entities[0]");
-        while(entities) {
-            cJSON *et = cJSON_Select(entities,".type:s");
-            cJSON *offset = cJSON_Select(entities,".offset:n");
-            cJSON *length = cJSON_Select(entities,".length:n");
+        cJSON *entity;
+        cJSON_ArrayForEach(entity,mf[MSG_ENTITIES]) {
+            cJSON *ef[ENT_COUNT];
+            botSelectMany(entity,&BotEntitySelector,ef);
+            cJSON *et = ef[ENT_TYPE];
+            cJSON *offset = ef[ENT_OFFSET];
+            cJSON *length = ef[ENT_LENGTH];
             if (et && offset && length && !strcmp(et->valuestring,"mention")) {
-                unsigned long off = offset->valuedouble;
-                unsigned long len = length->valuedouble;
+                int64_t off = cJSON_GetInt64(offset);
+                int64_t len = cJSON_GetInt64(length);
                 /* Don't trust Telegram offsets inside our stirng. */
-                if (off+len <= sdslen(br->request)) {
+                if (off >= 0 && len >= 0 &&
+                    off+len <= (int64_t)sdslen(br->request))
+                {
                     sds mention = sdsnewlen(br->request+off,len);
                     br->num_mentions++;
-                    br->mentions = xrealloc(br->mentions,br->num_mentions);
+                    br->mentions = xrealloc(br->mentions,
+                        sizeof(sds)*br->num_mentions);
                     br->mentions[br->num_mentions-1] = mention;
                     /* Is the user addressing the bot? Set the flag. */
                     if (Bot.username && !strcmp(Bot.username,mention+1))
                         br->bot_mentioned = 1;
                 }
             }
-            entities = entities->next;
         }
 
         br->type = type;
@@ -784,8 +1174,15 @@ int64_t botProcessUpdates(int64_t offset, int timeout) {
          * freeBotRequest(). */
     }
 
+    /* A syntax error inside the reply turns the broken update (or the
+     * whole result array) into an invalid item, that the loop above
+     * skipped: report it instead of treating it as a lack of updates. */
+    if (arena && cJSON_LazyError(json))
+        printf("Malformed getUpdates reply from Telegram API\n");
+
 fmterr:
-    cJSON_Delete(json);
+    cJSON_Delete(json); /* No-op if allocated in the arena. */
+    cJSON_ArenaReset(arena);
     sdsfree(body);
     return offset;
 }
@@ -801,9 +1198,12 @@ fmterr:
 void botMain(void) {
     int64_t nextid = -100; /* Start getting the last 100 messages. */
     int previd;
+    time_t last_profile_dump = time(NULL);
 
     botGetUsername(); // Will cache Bot.username as side effect.
-    while(1) {
+    Bot.kvexpire = xmalloc(sizeof(kvExpireState)*Bot.numshards);
+    memset(Bot.kvexpire,0,sizeof(kvExpireState)*Bot.numshards);
+    while(!BotShutdown) {
         previd = nextid;
         nextid = botProcessUpdates(nextid,1);
         /* We don't want to saturate all the CPU in a busy loop in case
@@ -812,7 +1212,41 @@ void botMain(void) {
          * if we didn't made any progresses with the ID. */
         if (nextid == previd) usleep(100000);
         if (Bot.cron_callback) Bot.cron_callback(DbHandle);
+
+        /* Delete the expired keys of the KV store, if any. */
+        for (int j = 0; j < Bot.numshards; j++) {
+            sqlite3 *db = Bot.dbpools ? botShardHandle(j) : DbHandle;
+            kvExpireCycle(db,Bot.kvexpire+j);
+        }
+
+        /* Write the counters incremented via kvIncrByBuffered(). */
+        kvFlushCounters(0);
+
+        /* Delete the expired keys of the in memory KV namespace. */
+        kvMemExpireCycle();
+
+        /* Refresh the queries profile file from time to time. */
+        if (Bot.profile_file && time(NULL)-last_profile_dump >= 60) {
+            if (!sqlProfileDump(Bot.profile_file))
+                printf("Can't write the queries profile to %s\n",
+                    Bot.profile_file);
+            last_profile_dump = time(NULL);
+        }
     }
+
+    /* Shutdown requested: don't lose the buffered counters and the in
+     * memory keys. */
+    printf("Shutting down...\n");
+    kvFlushCounters(1);
+    if (Bot.memfile && !kvMemSave(Bot.memfile))
+        printf("Can't save the in memory keys to %s\n", Bot.memfile);
+}
+
+/* SIGINT / SIGTERM handler: just ask botMain() to return, so that the
+ * shutdown tasks are performed outside of the signal handler. */
+static void botSignalHandler(int sig) {
+    UNUSED(sig);
+    BotShutdown = 1;
 }
 
 /* Check if a file named 'apikey.txt' exists, if so load the Telegram bot
@@ -836,6 +1270,11 @@ void readApiKeyFromFile(void) {
 void resetBotStats(void) {
     botStats.start_time = time(NULL);
     botStats.queries = 0;
+    botStats.snapshot_in_progress = 0;
+    botStats.snapshot_time = 0;
+    botStats.snapshot_ok = 0;
+    botStats.snapshot_bytes = 0;
+    botStats.snapshot_us = 0;
 }
 
 int startBot(char *createdb_query, int argc, char **argv, int flags, TBRequestCallback req_callback, TBCronCallback cron_callback, char **triggers) {
@@ -848,6 +1287,15 @@ int startBot(char *createdb_query, int argc, char **argv, int flags, TBRequestCa
     Bot.apikey = NULL;
     Bot.req_callback = req_callback;
     Bot.cron_callback = cron_callback;
+    Bot.flags = flags;
+    Bot.dbpools = NULL;
+    Bot.numshards = 1;
+    Bot.kvcache = 0;
+    Bot.kvcompress = 0;
+    Bot.kvbloom = 0;
+    Bot.memfile = NULL;
+    Bot.profile_file = NULL;
+    Bot.slowlog = 0;
 
     /* Parse options. */
     for (int j = 1; j < argc; j++) {
@@ -861,10 +1309,27 @@ int startBot(char *createdb_query, int argc, char **argv, int flags, TBRequestCa
             Bot.apikey = sdsnew(argv[++j]);
         } else if (!strcmp(argv[j],"--dbfile") && morearg) {
             Bot.dbfile = argv[++j];
+        } else if (!strcmp(argv[j],"--shards") && morearg) {
+            Bot.numshards = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--kvcache") && morearg) {
+            Bot.kvcache = (size_t)atoll(argv[++j])*1024*1024;
+        } else if (!strcmp(argv[j],"--kvcompress") && morearg) {
+            Bot.kvcompress = (size_t)atoll(argv[++j]);
+        } else if (!strcmp(argv[j],"--kvbloom")) {
+            Bot.kvbloom = 1;
+        } else if (!strcmp(argv[j],"--memfile") && morearg) {
+            Bot.memfile = argv[++j];
+        } else if (!strcmp(argv[j],"--profile") && morearg) {
+            Bot.profile_file = argv[++j];
+        } else if (!strcmp(argv[j],"--slowlog") && morearg) {
+            Bot.slowlog = atoll(argv[++j]);
         } else if (!(flags & TB_FLAGS_IGNORE_BAD_ARG)) {
             printf(
             "Usage: %s [--apikey <apikey>] [--debug] [--verbose] "
-            "[--dbfile <filename>]"
+            "[--dbfile <filename>] [--shards <count>] "
+            "[--kvcache <megabytes>] [--kvcompress <bytes>] "
+            "[--kvbloom] [--memfile <filename>] "
+            "[--profile <filename>] [--slowlog <milliseconds>]"
             "\n",argv[0]);
             exit(1);
         }
@@ -879,11 +1344,40 @@ int startBot(char *createdb_query, int argc, char **argv, int flags, TBRequestCa
                "apikey.txt in the bot working directory.\n");
         exit(1);
     }
+    if (Bot.numshards != 1) {
+        if (Bot.numshards < 1 || Bot.numshards > SQL_MAX_POOLS ||
+            strstr(Bot.dbfile,"%d") == NULL ||
+            (flags & TB_FLAGS_NO_DB_POOL))
+        {
+            printf("--shards requires a number of shards between 1 and %d, "
+                   "a --dbfile pattern containing \"%%d\", and the "
+                   "connections pool to be enabled.\n", SQL_MAX_POOLS);
+            exit(1);
+        }
+    }
     resetBotStats();
+    if (Bot.profile_file || Bot.slowlog) sqlProfileEnable(Bot.slowlog);
+    kvSetCompression(Bot.kvcompress);
+    if (Bot.memfile && access(Bot.memfile,F_OK) == 0 &&
+        !kvMemLoad(Bot.memfile))
+    {
+        printf("Warning: can't load the in memory keys from %s\n",
+            Bot.memfile);
+    }
+
+    /* Give botMain() the chance to flush the buffered counters and save
+     * the in memory keys on exit. */
+    struct sigaction sa;
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler = botSignalHandler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT,&sa,NULL);
+    sigaction(SIGTERM,&sa,NULL);
     DbHandle = dbInit(createdb_query);
     if (DbHandle == NULL) exit(1);
     cJSON_Hooks jh = {.malloc_fn = xmalloc, .free_fn = xfree};
     cJSON_InitHooks(&jh);
+    pthread_once(&BotSelectorsOnce,botCompileSelectors);
 
     /* Enter the infinite loop handling the bot. */
     botMain();
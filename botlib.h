@@ -5,6 +5,7 @@
 #define UNUSED(V) ((void) V)
 #endif
 
+#include <stdarg.h>
 #include <sqlite3.h>
 
 #include "sds.h"
@@ -13,6 +14,9 @@
 
 #define TB_FLAGS_NONE 0
 #define TB_FLAGS_IGNORE_BAD_ARG (1<<0)
+#define TB_FLAGS_NO_DB_POOL (1<<1)  /* Give each request thread its own
+                                       read-write connection instead of
+                                       using the connections pool. */
 
 /* This structure is passed to the thread processing a given user request,
  * it's up to the thread to free it once it is done. */
@@ -59,7 +63,22 @@ typedef void (*TBCronCallback)(sqlite3 *dbhandle);
                                         "key TEXT, " \
                                         "value BLOB);" \
     "CREATE UNIQUE INDEX IF NOT EXISTS idx_kv_key ON KeyValue(key);" \
-    "CREATE INDEX IF NOT EXISTS idx_ex_key ON KeyValue(expire);"
+    "CREATE INDEX IF NOT EXISTS idx_ex_key ON KeyValue(expire);" \
+    "CREATE TABLE IF NOT EXISTS KeyHash(key TEXT, " \
+                                       "field TEXT, " \
+                                       "value BLOB);" \
+    "CREATE UNIQUE INDEX IF NOT EXISTS idx_hash_key ON KeyHash(key,field);" \
+    "CREATE TABLE IF NOT EXISTS KeyList(key TEXT, " \
+                                       "idx INT, " \
+                                       "value BLOB);" \
+    "CREATE UNIQUE INDEX IF NOT EXISTS idx_list_key ON KeyList(key,idx);" \
+    "CREATE TABLE IF NOT EXISTS KeySortedSet(key TEXT, " \
+                                            "member TEXT, " \
+                                            "score REAL);" \
+    "CREATE UNIQUE INDEX IF NOT EXISTS idx_zset_key " \
+        "ON KeySortedSet(key,member);" \
+    "CREATE INDEX IF NOT EXISTS idx_zset_score " \
+        "ON KeySortedSet(key,score,member);"
 
 /* Allocation. */
 void *xmalloc(size_t size);
@@ -69,33 +88,134 @@ void xfree(void *ptr);
 /* HTTP */
 sds makeHTTPGETCallOpt(const char *url, int *resptr, char **optlist, int optnum);
 sds makeHTTPGETCall(const char *url, int *resptr);
+sds makeHTTPPOSTJSONCall(const char *url, int *resptr, sds json);
 
 /* Telegram bot API. */
 
 int startBot(char *createdb_query, int argc, char **argv, int flags, TBRequestCallback req_callback, TBCronCallback cron_callback, char **triggers);
 sds makeGETBotRequest(const char *action, int *resptr, char **optlist, int numopt);
+sds makeJSONBotRequest(const char *action, int *resptr, sds json);
 int botSendMessageAndGetInfo(int64_t target, sds text, int64_t reply_to, int64_t *chat_id, int64_t *message_id);
 int botSendMessage(int64_t target, sds text, int64_t reply_to);
 int botEditMessageText(int64_t chat_id, int message_id, sds text);
 int botSendImage(int64_t target, char *filename);
 int botGetFile(BotRequest *br, const char *target_filename);
 char *botGetUsername(void);
+int botShardForTarget(int64_t target);
+int botNumShards(void);
+sqlite3 *botShardHandle(int shard);
+int botSnapshot(const char *dest);
+sds botGetSnapshotInfo(void);
+void botForEachShard(void (*fn)(sqlite3 *dbhandle, int shard, void *privdata), void *privdata);
 void freeBotRequest(BotRequest *br);
 
 /* Database. */
+sqlPool *sqlPoolCreate(const char *filename, const char *createdb_query);
+sqlite3 *sqlPoolGetReader(sqlPool *pool);
+void sqlPoolReleaseReader(sqlPool *pool, sqlite3 *db);
+sqlPool *sqlPoolOf(sqlite3 *db);
+int sqlBackup(const char *src, const char *dst, int pages, int sleep_ms, sqlBackupStats *stats);
+void sqlProfileEnable(int64_t slowlog_ms);
+void sqlProfileAttach(sqlite3 *db);
+sds sqlProfileReport(void);
+int sqlProfileDump(const char *filename);
 int kvSetLen(sqlite3 *dbhandle, const char *key, const char *value, size_t vlen, int64_t expire);
 int kvSet(sqlite3 *dbhandle, const char *key, const char *value, int64_t expire);
 sds kvGet(sqlite3 *dbhandle, const char *key);
 void kvDel(sqlite3 *dbhandle, const char *key);
+int kvMSet(sqlite3 *dbhandle, const char **keys, const char **values, const size_t *vlens, int count, int64_t expire);
+sds *kvMGet(sqlite3 *dbhandle, const char **keys, int count);
+int64_t kvIncrBy(sqlite3 *dbhandle, const char *key, int64_t delta, int64_t expire, int *retval);
+int64_t kvDecrBy(sqlite3 *dbhandle, const char *key, int64_t delta, int64_t expire, int *retval);
+void kvIncrByBuffered(sqlite3 *dbhandle, const char *key, int64_t delta, int64_t expire);
+int kvFlushCounters(int force);
+int kvHSetLen(sqlite3 *dbhandle, const char *key, const char *field, const char *value, size_t vlen);
+int kvHSet(sqlite3 *dbhandle, const char *key, const char *field, const char *value);
+sds kvHGet(sqlite3 *dbhandle, const char *key, const char *field);
+int kvHDel(sqlite3 *dbhandle, const char *key, const char *field);
+int64_t kvHIncrBy(sqlite3 *dbhandle, const char *key, const char *field, int64_t delta, int *retval);
+int64_t kvHLen(sqlite3 *dbhandle, const char *key);
+sds *kvHGetAll(sqlite3 *dbhandle, const char *key, int *count);
+int kvLPush(sqlite3 *dbhandle, const char *key, const char *value, size_t vlen);
+int kvRPush(sqlite3 *dbhandle, const char *key, const char *value, size_t vlen);
+sds kvLPop(sqlite3 *dbhandle, const char *key);
+sds kvRPop(sqlite3 *dbhandle, const char *key);
+int64_t kvLLen(sqlite3 *dbhandle, const char *key);
+sds *kvLRange(sqlite3 *dbhandle, const char *key, int64_t start, int64_t stop, int *count);
+int kvZAdd(sqlite3 *dbhandle, const char *key, const char *member, double score);
+double kvZIncrBy(sqlite3 *dbhandle, const char *key, const char *member, double delta, int *retval);
+int kvZRem(sqlite3 *dbhandle, const char *key, const char *member);
+int kvZScore(sqlite3 *dbhandle, const char *key, const char *member, double *score);
+int64_t kvZCard(sqlite3 *dbhandle, const char *key);
+int64_t kvZRank(sqlite3 *dbhandle, const char *key, const char *member, int rev);
+sds *kvZRange(sqlite3 *dbhandle, const char *key, int64_t start, int64_t stop, int rev, double **scores, int *count);
+sds *kvScan(sqlite3 *dbhandle, const char *prefix, sds *cursor, int count, sds **values, int *numkeys);
+sds kvCacheInfo(sqlite3 *dbhandle);
+int kvBloomEnable(sqlite3 *dbhandle);
+sds kvBloomInfo(sqlite3 *dbhandle);
+void kvSetCompression(size_t threshold);
+sds kvCompressionInfo(void);
+void kvMemSetLen(const char *key, const char *value, size_t vlen, int64_t expire);
+void kvMemSet(const char *key, const char *value, int64_t expire);
+sds kvMemGet(const char *key);
+int kvMemDel(const char *key);
+int kvMemExpireCycle(void);
+int kvMemSave(const char *filename);
+int kvMemLoad(const char *filename);
+sds kvMemInfo(void);
+int kvExpireCycle(sqlite3 *dbhandle, kvExpireState *state);
 void sqlEnd(sqlRow *row);
 int sqlNextRow(sqlRow *row);
+int sqlNextRowLazy(sqlRow *row);
+sqlCol *sqlColumn(sqlRow *row, int idx);
 int sqlInsert(sqlite3 *dbhandle, const char *sql, ...);
 int sqlQuery(sqlite3 *dbhandle, const char *sql, ...);
 int sqlSelect(sqlite3 *dbhandle, sqlRow *row, const char *sql, ...);
 int sqlSelectOneRow(sqlite3 *dbhandle, sqlRow *row, const char *sql, ...);
 int64_t sqlSelectInt(sqlite3 *dbhandle, const char *sql, ...);
+int sqlGenericQueryArgv(sqlite3 *dbhandle, sqlRow *row, const char *sql, const sqlArg *argv, int argc);
+int sqlInsertArgv(sqlite3 *dbhandle, const char *sql, const sqlArg *argv, int argc);
+int sqlQueryArgv(sqlite3 *dbhandle, const char *sql, const sqlArg *argv, int argc);
+int sqlSelectArgv(sqlite3 *dbhandle, sqlRow *row, const char *sql, const sqlArg *argv, int argc);
+int sqlSelectOneRowArgv(sqlite3 *dbhandle, sqlRow *row, const char *sql, const sqlArg *argv, int argc);
+int64_t sqlSelectIntArgv(sqlite3 *dbhandle, const char *sql, const sqlArg *argv, int argc);
 
 /* Json */
+typedef struct cJSON_Selector cJSON_Selector;
 cJSON *cJSON_Select(cJSON *o, const char *fmt, ...);
+cJSON_Selector *cJSON_SelectCompile(const char *fmt);
+void cJSON_SelectFree(cJSON_Selector *sel);
+cJSON *cJSON_SelectCompiled(cJSON *o, const cJSON_Selector *sel, ...);
+cJSON *cJSON_SelectCompiledV(cJSON *o, const cJSON_Selector *sel, va_list *ap);
+typedef struct cJSON_MultiSelector cJSON_MultiSelector;
+cJSON_MultiSelector *cJSON_SelectManyCompile(const char **paths, int n);
+void cJSON_SelectManyFree(cJSON_MultiSelector *ms);
+void cJSON_SelectManyCompiled(cJSON *o, const cJSON_MultiSelector *ms, cJSON **out);
+int cJSON_SelectMany(cJSON *o, const char **paths, cJSON **out, int n);
+
+/* Streaming JSON writer, see json_wrap.c. */
+#define JSON_WRITER_MAX_DEPTH 64
+typedef struct jsonWriter {
+    sds buf;            /* JSON emitted so far. */
+    int depth;          /* Number of open arrays/objects. */
+    uint64_t nonempty;  /* Bit N-1 set if the container at depth N
+                           already has elements, so needs a comma. */
+    int afterkey;       /* True if a key was just emitted. */
+} jsonWriter;
+
+void jsonWriterInit(jsonWriter *w, sds buf);
+sds jsonWriterDone(jsonWriter *w);
+void jsonWriterObjectStart(jsonWriter *w);
+void jsonWriterObjectEnd(jsonWriter *w);
+void jsonWriterArrayStart(jsonWriter *w);
+void jsonWriterArrayEnd(jsonWriter *w);
+void jsonWriterKey(jsonWriter *w, const char *key);
+void jsonWriterString(jsonWriter *w, const char *s);
+void jsonWriterStringLen(jsonWriter *w, const char *s, size_t len);
+void jsonWriterInt(jsonWriter *w, int64_t value);
+void jsonWriterDouble(jsonWriter *w, double value);
+void jsonWriterBool(jsonWriter *w, int value);
+void jsonWriterNull(jsonWriter *w);
+void jsonWriterRaw(jsonWriter *w, const char *json);
 
 #endif
@@ -58,6 +58,17 @@
 
 #include "cJSON.h"
 
+/* SIMD string scanning: SSE2 is always available on x86-64, AVX2 is
+ * selected at runtime, NEON is always available on AArch64. Define
+ * CJSON_DISABLE_SIMD to use the portable code only. */
+#if !defined(CJSON_DISABLE_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__SSE2__))
+#define CJSON_SIMD_SSE2
+#include <immintrin.h>
+#elif !defined(CJSON_DISABLE_SIMD) && defined(__GNUC__) && defined(__aarch64__)
+#define CJSON_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
 /* define our own boolean type */
 #ifdef true
 #undef true
@@ -116,6 +127,16 @@ CJSON_PUBLIC(double) cJSON_GetNumberValue(const cJSON * const item)
     return item->valuedouble;
 }
 
+CJSON_PUBLIC(int64_t) cJSON_GetInt64(const cJSON * const item)
+{
+    if (!cJSON_IsNumber(item))
+    {
+        return 0;
+    }
+
+    return item->valueint64;
+}
+
 /* This is a safeguard to prevent copy-pasters from using incompatible C and header files */
 #if (CJSON_VERSION_MAJOR != 1) || (CJSON_VERSION_MINOR != 7) || (CJSON_VERSION_PATCH != 14)
     #error cJSON.h and cJSON.c have different versions. Make sure that both have the same.
@@ -153,6 +174,190 @@ static int case_insensitive_strcmp(const unsigned char *string1, const unsigned
     return tolower(*string1) - tolower(*string2);
 }
 
+/* Fast scanning of strings.
+ *
+ * Most of the bytes of a JSON document are inside strings, and most of
+ * them need no special handling: scan_string() returns the offset of the
+ * first byte in p[0..len-1] that is a quote or a backslash, or a control
+ * character if 'control' is true, or 'len' if there is none, testing 16
+ * or 32 bytes at a time where SIMD instructions are available.
+ * skip_whitespace() returns the offset of the first byte that is not
+ * whitespace (every byte <= 32, as cJSON always did). */
+static size_t scan_string_scalar(const unsigned char *p, size_t len, int control)
+{
+    size_t i = 0;
+    for (i = 0; i < len; i++)
+    {
+        if ((p[i] == '\"') || (p[i] == '\\') || (control && (p[i] < 32)))
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+static size_t skip_whitespace_scalar(const unsigned char *p, size_t len)
+{
+    size_t i = 0;
+    while ((i < len) && (p[i] <= 32))
+    {
+        i++;
+    }
+    return i;
+}
+
+#if defined(CJSON_SIMD_SSE2)
+static size_t scan_string_sse2(const unsigned char *p, size_t len, int control)
+{
+    const __m128i quote = _mm_set1_epi8('\"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(31);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(const void*)(p + i));
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash));
+        unsigned int mask = 0;
+        if (control)
+        {
+            /* x <= 31 unsigned, that is max(x,31) == 31. */
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(x, ctrl), ctrl));
+        }
+        mask = (unsigned int)_mm_movemask_epi8(m);
+        if (mask != 0)
+        {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    return i + scan_string_scalar(p + i, len - i, control);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_string_avx2(const unsigned char *p, size_t len, int control)
+{
+    const __m256i quote = _mm256_set1_epi8('\"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i ctrl = _mm256_set1_epi8(31);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(const void*)(p + i));
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(x, quote), _mm256_cmpeq_epi8(x, backslash));
+        unsigned int mask = 0;
+        if (control)
+        {
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi8(_mm256_max_epu8(x, ctrl), ctrl));
+        }
+        mask = (unsigned int)_mm256_movemask_epi8(m);
+        if (mask != 0)
+        {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    return i + scan_string_sse2(p + i, len - i, control);
+}
+
+static size_t skip_whitespace_sse2(const unsigned char *p, size_t len)
+{
+    const __m128i space = _mm_set1_epi8(32);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(const void*)(p + i));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(x, space), space));
+        if (mask != 0xFFFF)
+        {
+            return i + (size_t)__builtin_ctz(~mask);
+        }
+    }
+    return i + skip_whitespace_scalar(p + i, len - i);
+}
+#elif defined(CJSON_SIMD_NEON)
+static size_t scan_string_neon(const unsigned char *p, size_t len, int control)
+{
+    const uint8x16_t quote = vdupq_n_u8('\"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t ctrl = vdupq_n_u8(31);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        uint8x16_t x = vld1q_u8(p + i);
+        uint8x16_t m = vorrq_u8(vceqq_u8(x, quote), vceqq_u8(x, backslash));
+        if (control)
+        {
+            m = vorrq_u8(m, vcleq_u8(x, ctrl));
+        }
+        if (vmaxvq_u8(m) != 0)
+        {
+            break; /* The scalar code finds the exact position. */
+        }
+    }
+    return i + scan_string_scalar(p + i, len - i, control);
+}
+
+static size_t skip_whitespace_neon(const unsigned char *p, size_t len)
+{
+    const uint8x16_t space = vdupq_n_u8(32);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        if (vminvq_u8(vcleq_u8(vld1q_u8(p + i), space)) == 0)
+        {
+            break;
+        }
+    }
+    return i + skip_whitespace_scalar(p + i, len - i);
+}
+#endif
+
+static size_t scan_string(const unsigned char *p, size_t len, int control)
+{
+    /* Short strings are common: don't pay the SIMD setup for them. */
+    if (len < 16)
+    {
+        return scan_string_scalar(p, len, control);
+    }
+#if defined(CJSON_SIMD_SSE2)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return scan_string_avx2(p, len, control);
+    }
+    return scan_string_sse2(p, len, control);
+#elif defined(CJSON_SIMD_NEON)
+    return scan_string_neon(p, len, control);
+#else
+    return scan_string_scalar(p, len, control);
+#endif
+}
+
+static size_t skip_whitespace(const unsigned char *p, size_t len)
+{
+    size_t i = 0;
+
+    /* Compact JSON has no whitespace, and formatted JSON has mostly short
+     * runs of it: check a few bytes before going SIMD. */
+    while ((i < len) && (i < 8))
+    {
+        if (p[i] > 32)
+        {
+            return i;
+        }
+        i++;
+    }
+#if defined(CJSON_SIMD_SSE2)
+    return i + skip_whitespace_sse2(p + i, len - i);
+#elif defined(CJSON_SIMD_NEON)
+    return i + skip_whitespace_neon(p + i, len - i);
+#else
+    return i + skip_whitespace_scalar(p + i, len - i);
+#endif
+}
+
 typedef struct internal_hooks
 {
     void *(CJSON_CDECL *allocate)(size_t size);
@@ -237,6 +442,147 @@ CJSON_PUBLIC(void) cJSON_InitHooks(cJSON_Hooks* hooks)
     }
 }
 
+/* Parse arenas.
+ *
+ * Parsing allocates a node for each value and a string for each key and
+ * string value, and cJSON_Delete() frees them one by one. An arena is a
+ * list of chunks where cJSON_ParseArena() allocates by bumping a pointer,
+ * so that the whole tree is released at once by cJSON_ArenaReset(). When
+ * a parse didn't fit into a single chunk, the reset replaces the chunks
+ * with a single one as big as all of them, so an arena reused for similar
+ * payloads ends performing no allocation at all. However chunks bigger
+ * than CJSON_ARENA_MAX_RETAINED are not retained: after the reset the
+ * arena goes back to its initial size, so that a single huge payload does
+ * not pin its memory for the whole life of a long lived arena. */
+#define CJSON_ARENA_DEFAULT_SIZE (64*1024)
+#define CJSON_ARENA_MAX_RETAINED (1024*1024)
+#define CJSON_ARENA_ALIGN 16
+
+typedef struct arena_chunk
+{
+    struct arena_chunk *next;
+    size_t size; /* Usable bytes in data[]. */
+    size_t used;
+    union
+    {
+        double d;
+        void *p;
+        long long ll;
+    } data[]; /* Aligned start of the chunk memory. */
+} arena_chunk;
+
+struct cJSON_Arena
+{
+    arena_chunk *chunks; /* Current chunk first. */
+    size_t size; /* Size of new chunks. */
+    size_t initial_size; /* Size requested on creation. */
+};
+
+static arena_chunk *arena_new_chunk(size_t size)
+{
+    arena_chunk *chunk = (arena_chunk*)global_hooks.allocate(sizeof(arena_chunk) + size);
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+static void *arena_allocate(cJSON_Arena *arena, size_t size)
+{
+    arena_chunk *chunk = arena->chunks;
+    void *ptr = NULL;
+
+    size = (size + (CJSON_ARENA_ALIGN - 1)) & ~(size_t)(CJSON_ARENA_ALIGN - 1);
+    if ((chunk == NULL) || (chunk->size - chunk->used < size))
+    {
+        chunk = arena_new_chunk((size > arena->size) ? size : arena->size);
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    ptr = (unsigned char*)chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+CJSON_PUBLIC(cJSON_Arena *) cJSON_ArenaCreate(size_t size)
+{
+    cJSON_Arena *arena = (cJSON_Arena*)global_hooks.allocate(sizeof(cJSON_Arena));
+    if (arena == NULL)
+    {
+        return NULL;
+    }
+    arena->size = (size == 0) ? CJSON_ARENA_DEFAULT_SIZE : size;
+    arena->initial_size = arena->size;
+    arena->chunks = arena_new_chunk(arena->size);
+    if (arena->chunks == NULL)
+    {
+        global_hooks.deallocate(arena);
+        return NULL;
+    }
+    return arena;
+}
+
+CJSON_PUBLIC(void) cJSON_ArenaReset(cJSON_Arena *arena)
+{
+    arena_chunk *chunk = NULL;
+    size_t total = 0;
+
+    if (arena == NULL)
+    {
+        return;
+    }
+    if ((arena->chunks != NULL) && (arena->chunks->next == NULL) && (arena->chunks->size <= arena->size))
+    {
+        arena->chunks->used = 0;
+        return;
+    }
+
+    /* Many chunks, or an oversized one: replace them with a single one. */
+    while (arena->chunks != NULL)
+    {
+        chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        total += chunk->size;
+        global_hooks.deallocate(chunk);
+    }
+    if (total > CJSON_ARENA_MAX_RETAINED)
+    {
+        arena->size = arena->initial_size;
+    }
+    else if (total > arena->size)
+    {
+        arena->size = total;
+    }
+    /* On out of memory the arena stays empty, and the next allocation
+     * will try again. */
+    arena->chunks = arena_new_chunk(arena->size);
+}
+
+CJSON_PUBLIC(void) cJSON_ArenaDelete(cJSON_Arena *arena)
+{
+    arena_chunk *chunk = NULL;
+
+    if (arena == NULL)
+    {
+        return;
+    }
+    while (arena->chunks != NULL)
+    {
+        chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        global_hooks.deallocate(chunk);
+    }
+    global_hooks.deallocate(arena);
+}
+
 /* Internal constructor. */
 static cJSON *cJSON_New_Item(const internal_hooks * const hooks)
 {
@@ -256,10 +602,20 @@ CJSON_PUBLIC(void) cJSON_Delete(cJSON *item)
     while (item != NULL)
     {
         next = item->next;
+        if (item->type & cJSON_InArena)
+        {
+            /* Released by cJSON_ArenaReset(). */
+            item = next;
+            continue;
+        }
         if (!(item->type & cJSON_IsReference) && (item->child != NULL))
         {
             cJSON_Delete(item->child);
         }
+        if (item->index != NULL)
+        {
+            global_hooks.deallocate(item->index);
+        }
         if (!(item->type & cJSON_IsReference) && (item->valuestring != NULL))
         {
             global_hooks.deallocate(item->valuestring);
@@ -291,8 +647,53 @@ typedef struct
     size_t offset;
     size_t depth; /* How deeply nested (in arrays/objects) is the input at the current offset. */
     internal_hooks hooks;
+    cJSON_Arena *arena; /* Allocate from this arena if not NULL. */
 } parse_buffer;
 
+/* Allocation of parsed nodes and strings. */
+static void *parse_allocate(const parse_buffer * const input_buffer, size_t size)
+{
+    if (input_buffer->arena != NULL)
+    {
+        return arena_allocate(input_buffer->arena, size);
+    }
+    return input_buffer->hooks.allocate(size);
+}
+
+static cJSON *parse_new_item(const parse_buffer * const input_buffer)
+{
+    cJSON *node = NULL;
+    if (input_buffer->arena == NULL)
+    {
+        return cJSON_New_Item(&(input_buffer->hooks));
+    }
+    node = (cJSON*)arena_allocate(input_buffer->arena, sizeof(cJSON));
+    if (node)
+    {
+        memset(node, '\0', sizeof(cJSON));
+    }
+    return node;
+}
+
+/* Free a partially parsed tree on error. Arena nodes are not flagged yet,
+ * and will be released with the arena anyway. */
+static void parse_delete(const parse_buffer * const input_buffer, cJSON *item)
+{
+    if (input_buffer->arena == NULL)
+    {
+        cJSON_Delete(item);
+    }
+}
+
+/* Flag as arena allocated a node that parse_value() just filled. */
+static void parse_flag(const parse_buffer * const input_buffer, cJSON *item)
+{
+    if (input_buffer->arena != NULL)
+    {
+        item->type |= cJSON_InArena;
+    }
+}
+
 /* check if the given size is left to read in a given parse buffer (starting with 1) */
 #define can_read(buffer, size) ((buffer != NULL) && (((buffer)->offset + size) <= (buffer)->length))
 /* check if the buffer can be accessed at the given index (starting with 0) */
@@ -301,6 +702,110 @@ typedef struct
 /* get a pointer to the buffer at the position */
 #define buffer_at_offset(buffer) ((buffer)->content + (buffer)->offset)
 
+/* Set valueint and valueint64 of a number from its double value, with
+ * saturation in case of overflow. */
+static void set_number_ints(cJSON * const item, double number)
+{
+    if (number >= INT_MAX)
+    {
+        item->valueint = INT_MAX;
+    }
+    else if (number <= (double)INT_MIN)
+    {
+        item->valueint = INT_MIN;
+    }
+    else
+    {
+        item->valueint = (int)number;
+    }
+
+    /* 2^63 is exactly representable, INT64_MAX is not. */
+    if (number >= 9223372036854775808.0)
+    {
+        item->valueint64 = INT64_MAX;
+    }
+    else if (number <= (double)INT64_MIN)
+    {
+        item->valueint64 = INT64_MIN;
+    }
+    else if (number != number)
+    {
+        item->valueint64 = 0; /* NaN */
+    }
+    else
+    {
+        item->valueint64 = (int64_t)number;
+    }
+}
+
+/* Parse integers without fraction and exponent directly, without the
+ * locale aware copy and strtod(). Up to 19 digits always fit an uint64_t.
+ * Returns false if the number is not such an integer, or does not fit an
+ * int64_t, so that the caller parses it as a double. */
+static cJSON_bool parse_integer(cJSON * const item, parse_buffer * const input_buffer)
+{
+    const unsigned char *p = buffer_at_offset(input_buffer);
+    size_t avail = input_buffer->length - input_buffer->offset;
+    size_t j = 0;
+    size_t digits = 0;
+    cJSON_bool negative = false;
+    uint64_t u = 0;
+    int64_t number = 0;
+
+    if ((avail > 0) && (p[0] == '-'))
+    {
+        negative = true;
+        j++;
+    }
+    while ((j < avail) && (p[j] >= '0') && (p[j] <= '9') && (digits < 19))
+    {
+        u = (u * 10) + (uint64_t)(p[j] - '0');
+        j++;
+        digits++;
+    }
+    if ((digits == 0) || ((j < avail) && (((p[j] >= '0') && (p[j] <= '9')) || (p[j] == '.') || (p[j] == 'e') || (p[j] == 'E'))))
+    {
+        return false;
+    }
+    if (negative)
+    {
+        /* -0 is a double. */
+        if ((u == 0) || (u > (uint64_t)INT64_MAX + 1))
+        {
+            return false;
+        }
+        number = (u == (uint64_t)INT64_MAX + 1) ? INT64_MIN : -(int64_t)u;
+    }
+    else
+    {
+        if (u > (uint64_t)INT64_MAX)
+        {
+            return false;
+        }
+        number = (int64_t)u;
+    }
+
+    /* Converting the integer rounds to nearest exactly like strtod(). */
+    item->valuedouble = (double)number;
+    if (number >= INT_MAX)
+    {
+        item->valueint = INT_MAX;
+    }
+    else if (number <= INT_MIN)
+    {
+        item->valueint = INT_MIN;
+    }
+    else
+    {
+        item->valueint = (int)number;
+    }
+    item->valueint64 = number;
+    item->type = cJSON_Number;
+
+    input_buffer->offset += j;
+    return true;
+}
+
 /* Parse the input text to generate a number, and populate the result into item. */
 static cJSON_bool parse_number(cJSON * const item, parse_buffer * const input_buffer)
 {
@@ -315,6 +820,11 @@ static cJSON_bool parse_number(cJSON * const item, parse_buffer * const input_bu
         return false;
     }
 
+    if (parse_integer(item, input_buffer))
+    {
+        return true;
+    }
+
     /* copy the number into a temporary buffer and replace '.' with the decimal point
      * of the current locale (for strtod)
      * This also takes care of '\0' not necessarily being available for marking the end of the input */
@@ -357,20 +867,7 @@ loop_end:
     }
 
     item->valuedouble = number;
-
-    /* use saturation in case of overflow */
-    if (number >= INT_MAX)
-    {
-        item->valueint = INT_MAX;
-    }
-    else if (number <= (double)INT_MIN)
-    {
-        item->valueint = INT_MIN;
-    }
-    else
-    {
-        item->valueint = (int)number;
-    }
+    set_number_ints(item, number);
 
     item->type = cJSON_Number;
 
@@ -381,18 +878,7 @@ loop_end:
 /* don't ask me, but the original cJSON_SetNumberValue returns an integer or double */
 CJSON_PUBLIC(double) cJSON_SetNumberHelper(cJSON *object, double number)
 {
-    if (number >= INT_MAX)
-    {
-        object->valueint = INT_MAX;
-    }
-    else if (number <= (double)INT_MIN)
-    {
-        object->valueint = INT_MIN;
-    }
-    else
-    {
-        object->valueint = (int)number;
-    }
+    set_number_ints(object, number);
 
     return object->valuedouble = number;
 }
@@ -410,6 +896,11 @@ CJSON_PUBLIC(char*) cJSON_SetValuestring(cJSON *object, const char *valuestring)
         strcpy(object->valuestring, valuestring);
         return object->valuestring;
     }
+    if (object->type & cJSON_InArena)
+    {
+        /* The new string would never be freed. */
+        return NULL;
+    }
     copy = (char*) cJSON_strdup((const unsigned char*)valuestring, &global_hooks);
     if (copy == NULL)
     {
@@ -534,11 +1025,94 @@ static void update_offset(printbuffer * const buffer)
     buffer->offset += strlen((const char*)buffer_pointer);
 }
 
-/* securely comparison of floating-point variables */
-static cJSON_bool compare_double(double a, double b)
-{
-    double maxVal = fabs(a) > fabs(b) ? fabs(a) : fabs(b);
-    return (fabs(a - b) <= maxVal * DBL_EPSILON);
+/* securely comparison of floating-point variables */
+static cJSON_bool compare_double(double a, double b)
+{
+    double maxVal = fabs(a) > fabs(b) ? fabs(a) : fabs(b);
+    return (fabs(a - b) <= maxVal * DBL_EPSILON);
+}
+
+/* Write the decimal digits of 'number' into 'buffer', with the decimal
+ * point before the last 'decimals' digits, and return the length. */
+static int print_decimal(unsigned char *buffer, int64_t number, int decimals)
+{
+    unsigned char digits[24];
+    uint64_t u = (number < 0) ? (uint64_t)0 - (uint64_t)number : (uint64_t)number;
+    int count = 0;
+    int length = 0;
+
+    do
+    {
+        digits[count++] = (unsigned char)('0' + (u % 10));
+        u /= 10;
+    } while ((u != 0) || (count <= decimals));
+
+    if (number < 0)
+    {
+        buffer[length++] = '-';
+    }
+    while (count > 0)
+    {
+        if (count == decimals)
+        {
+            buffer[length++] = '.';
+        }
+        buffer[length++] = digits[--count];
+    }
+    buffer[length] = '\0';
+    return length;
+}
+
+/* Fast paths of print_number(), returning the length written into
+ * 'buffer', or 0 if the number must be printed with sprintf().
+ *
+ * Integers are printed from valueint64 when it holds the same value as
+ * valuedouble, so integers parsed from the JSON text are printed exactly
+ * even above 2^53. Other numbers are often short decimals, like prices:
+ * we look for the smallest number of decimals k such that d*10^k is an
+ * integer N below 10^15 and N/10^k gives back d. Since N and 10^k are
+ * exact doubles the division is correctly rounded, so the decimal text
+ * of N/10^k parses back to d as well, and having at most 15 significant
+ * digits it is exactly what "%1.15g" would print. Numbers below 1e-4 are
+ * left to sprintf(), that prints them with an exponent. */
+static int print_number_fast(const cJSON * const item, unsigned char *buffer)
+{
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+        1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17
+    };
+    double d = item->valuedouble;
+    double magnitude = (d < 0) ? -d : d;
+    int k = 0;
+
+    if ((d >= -9223372036854775808.0) && (d < 9223372036854775808.0) && ((double)item->valueint64 == d))
+    {
+        if ((d == 0) && signbit(d))
+        {
+            return 0; /* -0 */
+        }
+        return print_decimal(buffer, item->valueint64, 0);
+    }
+
+    if (!(magnitude >= 1e-4) || (magnitude >= 1e15))
+    {
+        return 0; /* Also NaN. */
+    }
+    for (k = 1; k < (int)(sizeof(powers) / sizeof(powers[0])); k++)
+    {
+        double scaled = d * powers[k];
+        int64_t number = 0;
+        if ((scaled >= 1e15) || (scaled <= -1e15))
+        {
+            break;
+        }
+        number = (int64_t)((scaled < 0) ? (scaled - 0.5) : (scaled + 0.5));
+        if (((double)number / powers[k]) == d)
+        {
+            return print_decimal(buffer, number, k);
+        }
+    }
+    return 0;
 }
 
 /* Render the number nicely from the given item into a string. */
@@ -562,16 +1136,25 @@ static cJSON_bool print_number(const cJSON * const item, printbuffer * const out
     {
         length = sprintf((char*)number_buffer, "null");
     }
+    else if ((length = print_number_fast(item, number_buffer)) > 0)
+    {
+        /* Printed without sprintf(). */
+    }
     else
     {
-        /* Try 15 decimal places of precision to avoid nonsignificant nonzero digits */
+        /* Try 15 decimal places of precision to avoid nonsignificant
+         * nonzero digits, then 16 and 17, that always round trip: the first
+         * that gives back exactly the original double is the shortest. */
         length = sprintf((char*)number_buffer, "%1.15g", d);
-
-        /* Check whether the original double can be recovered */
-        if ((sscanf((char*)number_buffer, "%lg", &test) != 1) || !compare_double((double)test, d))
+        test = strtod((const char*)number_buffer, NULL);
+        if (test != d)
         {
-            /* If not, print with 17 decimal places of precision */
-            length = sprintf((char*)number_buffer, "%1.17g", d);
+            length = sprintf((char*)number_buffer, "%1.16g", d);
+            test = strtod((const char*)number_buffer, NULL);
+            if (test != d)
+            {
+                length = sprintf((char*)number_buffer, "%1.17g", d);
+            }
         }
     }
 
@@ -783,20 +1366,22 @@ static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_bu
         /* calculate approximate size of the output (overestimate) */
         size_t allocation_length = 0;
         size_t skipped_bytes = 0;
-        while (((size_t)(input_end - input_buffer->content) < input_buffer->length) && (*input_end != '\"'))
+        while ((size_t)(input_end - input_buffer->content) < input_buffer->length)
         {
+            /* jump to the next quote or escape sequence */
+            input_end += scan_string(input_end, input_buffer->length - (size_t)(input_end - input_buffer->content), false);
+            if (((size_t)(input_end - input_buffer->content) >= input_buffer->length) || (*input_end == '\"'))
+            {
+                break;
+            }
             /* is escape sequence */
-            if (input_end[0] == '\\')
+            if ((size_t)(input_end + 1 - input_buffer->content) >= input_buffer->length)
             {
-                if ((size_t)(input_end + 1 - input_buffer->content) >= input_buffer->length)
-                {
-                    /* prevent buffer overflow when last input character is a backslash */
-                    goto fail;
-                }
-                skipped_bytes++;
-                input_end++;
+                /* prevent buffer overflow when last input character is a backslash */
+                goto fail;
             }
-            input_end++;
+            skipped_bytes++;
+            input_end += 2;
         }
         if (((size_t)(input_end - input_buffer->content) >= input_buffer->length) || (*input_end != '\"'))
         {
@@ -805,7 +1390,7 @@ static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_bu
 
         /* This is at most how much we need for the output */
         allocation_length = (size_t) (input_end - buffer_at_offset(input_buffer)) - skipped_bytes;
-        output = (unsigned char*)input_buffer->hooks.allocate(allocation_length + sizeof(""));
+        output = (unsigned char*)parse_allocate(input_buffer, allocation_length + sizeof(""));
         if (output == NULL)
         {
             goto fail; /* allocation failure */
@@ -818,7 +1403,12 @@ static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_bu
     {
         if (*input_pointer != '\\')
         {
-            *output_pointer++ = *input_pointer++;
+            /* copy everything up to the next escape sequence */
+            const unsigned char *escape = (const unsigned char*)memchr(input_pointer, '\\', (size_t)(input_end - input_pointer));
+            size_t run = (size_t)(((escape != NULL) ? escape : input_end) - input_pointer);
+            memcpy(output_pointer, input_pointer, run);
+            output_pointer += run;
+            input_pointer += run;
         }
         /* escape sequence */
         else
@@ -881,7 +1471,7 @@ static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_bu
     return true;
 
 fail:
-    if (output != NULL)
+    if ((output != NULL) && (input_buffer->arena == NULL))
     {
         input_buffer->hooks.deallocate(output);
     }
@@ -901,6 +1491,7 @@ static cJSON_bool print_string_ptr(const unsigned char * const input, printbuffe
     unsigned char *output = NULL;
     unsigned char *output_pointer = NULL;
     size_t output_length = 0;
+    size_t input_length = 0;
     /* numbers of additional characters needed for escaping */
     size_t escape_characters = 0;
 
@@ -923,8 +1514,14 @@ static cJSON_bool print_string_ptr(const unsigned char * const input, printbuffe
     }
 
     /* set "flag" to 1 if something needs to be escaped */
-    for (input_pointer = input; *input_pointer; input_pointer++)
+    input_length = strlen((const char*)input);
+    for (input_pointer = input; ; input_pointer++)
     {
+        input_pointer += scan_string(input_pointer, input_length - (size_t)(input_pointer - input), true);
+        if (*input_pointer == '\0')
+        {
+            break;
+        }
         switch (*input_pointer)
         {
             case '\"':
@@ -946,7 +1543,7 @@ static cJSON_bool print_string_ptr(const unsigned char * const input, printbuffe
                 break;
         }
     }
-    output_length = (size_t)(input_pointer - input) + escape_characters;
+    output_length = input_length + escape_characters;
 
     output = ensure(output_buffer, output_length + sizeof("\"\""));
     if (output == NULL)
@@ -972,8 +1569,11 @@ static cJSON_bool print_string_ptr(const unsigned char * const input, printbuffe
     {
         if ((*input_pointer > 31) && (*input_pointer != '\"') && (*input_pointer != '\\'))
         {
-            /* normal character, copy */
-            *output_pointer = *input_pointer;
+            /* normal characters, copy up to the next one to escape */
+            size_t run = scan_string(input_pointer, input_length - (size_t)(input_pointer - input), true);
+            memcpy(output_pointer, input_pointer, run);
+            output_pointer += run - 1;
+            input_pointer += run - 1;
         }
         else
         {
@@ -1043,10 +1643,7 @@ static parse_buffer *buffer_skip_whitespace(parse_buffer * const buffer)
         return buffer;
     }
 
-    while (can_access_at_index(buffer, 0) && (buffer_at_offset(buffer)[0] <= 32))
-    {
-       buffer->offset++;
-    }
+    buffer->offset += skip_whitespace(buffer_at_offset(buffer), buffer->length - buffer->offset);
 
     if (buffer->offset == buffer->length)
     {
@@ -1064,107 +1661,486 @@ static parse_buffer *skip_utf8_bom(parse_buffer * const buffer)
         return NULL;
     }
 
-    if (can_access_at_index(buffer, 4) && (strncmp((const char*)buffer_at_offset(buffer), "\xEF\xBB\xBF", 3) == 0))
+    if (can_access_at_index(buffer, 4) && (strncmp((const char*)buffer_at_offset(buffer), "\xEF\xBB\xBF", 3) == 0))
+    {
+        buffer->offset += 3;
+    }
+
+    return buffer;
+}
+
+CJSON_PUBLIC(cJSON *) cJSON_ParseWithOpts(const char *value, const char **return_parse_end, cJSON_bool require_null_terminated)
+{
+    size_t buffer_length;
+
+    if (NULL == value)
+    {
+        return NULL;
+    }
+
+    /* Adding null character size due to require_null_terminated. */
+    buffer_length = strlen(value) + sizeof("");
+
+    return cJSON_ParseWithLengthOpts(value, buffer_length, return_parse_end, require_null_terminated);
+}
+
+/* Parse an object - create a new root, and populate. */
+static cJSON *parse_root(const char *value, size_t buffer_length, const char **return_parse_end, cJSON_bool require_null_terminated, cJSON_Arena *arena)
+{
+    parse_buffer buffer = { 0, 0, 0, 0, { 0, 0, 0 }, 0 };
+    cJSON *item = NULL;
+
+    /* reset error position */
+    global_error.json = NULL;
+    global_error.position = 0;
+
+    if (value == NULL || 0 == buffer_length)
+    {
+        goto fail;
+    }
+
+    buffer.content = (const unsigned char*)value;
+    buffer.length = buffer_length; 
+    buffer.offset = 0;
+    buffer.hooks = global_hooks;
+    buffer.arena = arena;
+
+    item = parse_new_item(&buffer);
+    if (item == NULL) /* memory fail */
+    {
+        goto fail;
+    }
+
+    if (!parse_value(item, buffer_skip_whitespace(skip_utf8_bom(&buffer))))
+    {
+        /* parse failure. ep is set. */
+        goto fail;
+    }
+    parse_flag(&buffer, item);
+
+    /* if we require null-terminated JSON without appended garbage, skip and then check for a null terminator */
+    if (require_null_terminated)
+    {
+        buffer_skip_whitespace(&buffer);
+        if ((buffer.offset >= buffer.length) || buffer_at_offset(&buffer)[0] != '\0')
+        {
+            goto fail;
+        }
+    }
+    if (return_parse_end)
+    {
+        *return_parse_end = (const char*)buffer_at_offset(&buffer);
+    }
+
+    return item;
+
+fail:
+    if (item != NULL)
+    {
+        parse_delete(&buffer, item);
+    }
+
+    if (value != NULL)
+    {
+        error local_error;
+        local_error.json = (const unsigned char*)value;
+        local_error.position = 0;
+
+        if (buffer.offset < buffer.length)
+        {
+            local_error.position = buffer.offset;
+        }
+        else if (buffer.length > 0)
+        {
+            local_error.position = buffer.length - 1;
+        }
+
+        if (return_parse_end != NULL)
+        {
+            *return_parse_end = (const char*)local_error.json + local_error.position;
+        }
+
+        global_error = local_error;
+    }
+
+    return NULL;
+}
+
+CJSON_PUBLIC(cJSON *) cJSON_ParseWithLengthOpts(const char *value, size_t buffer_length, const char **return_parse_end, cJSON_bool require_null_terminated)
+{
+    return parse_root(value, buffer_length, return_parse_end, require_null_terminated, NULL);
+}
+
+CJSON_PUBLIC(cJSON *) cJSON_ParseArena(cJSON_Arena *arena, const char *value, size_t buffer_length)
+{
+    if (arena == NULL)
+    {
+        return NULL;
+    }
+    return parse_root(value, buffer_length, NULL, false, arena);
+}
+
+/* Lazy parsing.
+ *
+ * cJSON_ParseLazy() scans the document once, skipping strings, to find the
+ * arrays and objects and where each of them ends. This structural index
+ * is all that is built upfront: the root is returned as an empty item
+ * flagged cJSON_IsLazy, and the children of a lazy item are created only
+ * when they are accessed, by lazy_expand(). Scalar children are parsed
+ * on expansion, while arrays/objects children become lazy items in turn,
+ * jumping past their text with the index. So a selector reading a few
+ * fields parses only the objects on the path to them, and never looks
+ * inside the rest of the document, except for the initial scan.
+ *
+ * Containers are numbered in the order they appear in the document: a
+ * lazy item stores a pointer to the document in 'index', that is otherwise
+ * unused for arena items, and its number in 'lazy_container'. */
+typedef struct
+{
+    unsigned int open; /* Offset of the opening bracket. */
+    unsigned int close; /* Offset of the closing bracket. */
+    unsigned int next; /* Number of the first container after this one. */
+} lazy_container;
+
+typedef struct
+{
+    cJSON root; /* The returned item, first so cJSON_LazyError() finds us. */
+    cJSON_Arena *arena;
+    const unsigned char *content; /* Copy of the document. */
+    size_t length;
+    lazy_container *containers;
+    size_t count;
+    cJSON_bool error; /* Set when an expansion fails. */
+} lazy_document;
+
+/* Add a container to the index. The array grows in the arena: the old
+ * copies are wasted, but at most as much memory as the final array. */
+static lazy_container *lazy_add_container(lazy_document *doc, size_t *alloc)
+{
+    if (doc->count == *alloc)
+    {
+        size_t newalloc = (*alloc < 64) ? 64 : *alloc * 2;
+        lazy_container *bigger = (lazy_container*)arena_allocate(doc->arena, sizeof(lazy_container) * newalloc);
+        if (bigger == NULL)
+        {
+            return NULL;
+        }
+        if (doc->count > 0)
+        {
+            memcpy(bigger, doc->containers, sizeof(lazy_container) * doc->count);
+        }
+        doc->containers = bigger;
+        *alloc = newalloc;
+    }
+    return doc->containers + doc->count++;
+}
+
+/* Bytes the structural index scan stops at outside strings. The content
+ * is terminated by a null byte, so it stops the loop as well. */
+static const unsigned char lazy_structural[256] = {
+    1, ['\"'] = 1, ['{'] = 1, ['}'] = 1, ['['] = 1, [']'] = 1
+};
+
+/* Build the structural index, checking that brackets and strings are
+ * balanced, and that nothing but whitespace follows the root. */
+static cJSON_bool lazy_index(lazy_document *doc, size_t start)
+{
+    unsigned int stack[CJSON_NESTING_LIMIT];
+    size_t depth = 0;
+    size_t alloc = 0;
+    size_t i = start;
+    const unsigned char *p = doc->content;
+
+    if (doc->length > UINT_MAX)
+    {
+        return false;
+    }
+    for (;; i++)
+    {
+        lazy_container *c = NULL;
+        while (!lazy_structural[p[i]])
+        {
+            i++;
+        }
+        if (i >= doc->length)
+        {
+            break;
+        }
+        switch (p[i])
+        {
+            case '\"':
+                for (i++;; i++)
+                {
+                    i += scan_string(p + i, doc->length - i, false);
+                    if ((i >= doc->length) || (p[i] == '\"'))
+                    {
+                        break;
+                    }
+                    if ((p[i] == '\\') && (p[i + 1] != '\0'))
+                    {
+                        i++; /* Skip the escaped char. */
+                    }
+                }
+                if (i >= doc->length)
+                {
+                    return false; /* Unterminated string. */
+                }
+                break;
+            case '{':
+            case '[':
+                if (depth == CJSON_NESTING_LIMIT)
+                {
+                    return false;
+                }
+                c = lazy_add_container(doc, &alloc);
+                if (c == NULL)
+                {
+                    return false;
+                }
+                c->open = (unsigned int)i;
+                stack[depth++] = (unsigned int)(doc->count - 1);
+                break;
+            case '}':
+            case ']':
+                if (depth == 0)
+                {
+                    return false;
+                }
+                c = doc->containers + stack[--depth];
+                if (p[c->open] != ((p[i] == '}') ? '{' : '['))
+                {
+                    return false;
+                }
+                c->close = (unsigned int)i;
+                c->next = (unsigned int)doc->count;
+                if (depth == 0)
+                {
+                    /* End of the root: only whitespace may follow. */
+                    for (i++; i < doc->length; i++)
+                    {
+                        if (p[i] == '\0')
+                        {
+                            break;
+                        }
+                        if (p[i] > 32)
+                        {
+                            return false;
+                        }
+                    }
+                    return true;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return false; /* Root not closed. */
+}
+
+/* Turn 'item' into a lazy item for the container number 'number'. */
+static void lazy_init(cJSON *item, lazy_document *doc, size_t number)
+{
+    item->type = ((doc->content[doc->containers[number].open] == '{') ? cJSON_Object : cJSON_Array) | cJSON_InArena | cJSON_IsLazy;
+    item->index = doc;
+    item->lazy_container = (unsigned int)number;
+}
+
+/* Create the children of a lazy item. Returns false on syntax errors: in
+ * that case the item becomes cJSON_Invalid, so that lookups and selectors
+ * don't find anything inside it and printing it fails, and the error is
+ * recorded in the document for cJSON_LazyError(). */
+static cJSON_bool lazy_expand(cJSON *item)
+{
+    lazy_document *doc = (lazy_document*)item->index;
+    const lazy_container *container = doc->containers + item->lazy_container;
+    size_t next = item->lazy_container + 1;
+    cJSON_bool is_object = (doc->content[container->open] == '{');
+    parse_buffer buffer = { 0, 0, 0, 0, { 0, 0, 0 }, 0 };
+    cJSON *head = NULL;
+    cJSON *current_item = NULL;
+
+    buffer.content = doc->content;
+    buffer.length = doc->length;
+    buffer.offset = container->open + 1;
+    buffer.hooks = global_hooks;
+    buffer.arena = doc->arena;
+
+    item->type &= ~cJSON_IsLazy;
+    item->index = NULL;
+    item->lazy_container = 0;
+
+    buffer_skip_whitespace(&buffer);
+    while (buffer.offset != container->close)
+    {
+        cJSON *new_item = parse_new_item(&buffer);
+        unsigned char c = 0;
+        if (new_item == NULL)
+        {
+            goto fail;
+        }
+        if (head == NULL)
+        {
+            current_item = head = new_item;
+        }
+        else
+        {
+            current_item->next = new_item;
+            new_item->prev = current_item;
+            current_item = new_item;
+        }
+
+        if (is_object)
+        {
+            if (!parse_string(current_item, &buffer))
+            {
+                goto fail;
+            }
+            current_item->string = current_item->valuestring;
+            current_item->valuestring = NULL;
+            buffer_skip_whitespace(&buffer);
+            if (cannot_access_at_index(&buffer, 0) || (buffer_at_offset(&buffer)[0] != ':'))
+            {
+                goto fail;
+            }
+            buffer.offset++;
+            buffer_skip_whitespace(&buffer);
+        }
+
+        c = can_access_at_index(&buffer, 0) ? buffer_at_offset(&buffer)[0] : 0;
+        if ((c == '{') || (c == '['))
+        {
+            /* Nested containers appear in the index in document order. */
+            if ((next >= doc->count) || (doc->containers[next].open != buffer.offset))
+            {
+                goto fail;
+            }
+            lazy_init(current_item, doc, next);
+            buffer.offset = doc->containers[next].close + 1;
+            next = doc->containers[next].next;
+        }
+        else
+        {
+            if (!parse_value(current_item, &buffer))
+            {
+                goto fail;
+            }
+            parse_flag(&buffer, current_item);
+        }
+
+        buffer_skip_whitespace(&buffer);
+        if (cannot_access_at_index(&buffer, 0))
+        {
+            goto fail;
+        }
+        if (buffer_at_offset(&buffer)[0] == ',')
+        {
+            buffer.offset++;
+            buffer_skip_whitespace(&buffer);
+            if (buffer.offset == container->close)
+            {
+                goto fail; /* Trailing comma. */
+            }
+        }
+        else if (buffer.offset != container->close)
+        {
+            goto fail;
+        }
+    }
+
+    if (head != NULL)
     {
-        buffer->offset += 3;
+        head->prev = current_item;
     }
+    item->child = head;
+    return true;
 
-    return buffer;
+fail:
+    /* Children are in the arena, no need to free them. */
+    item->child = NULL;
+    item->type = cJSON_Invalid | cJSON_InArena;
+    doc->error = true;
+    return false;
 }
 
-CJSON_PUBLIC(cJSON *) cJSON_ParseWithOpts(const char *value, const char **return_parse_end, cJSON_bool require_null_terminated)
+CJSON_PUBLIC(cJSON *) cJSON_GetChild(const cJSON *item)
 {
-    size_t buffer_length;
-
-    if (NULL == value)
+    if (item == NULL)
     {
         return NULL;
     }
-
-    /* Adding null character size due to require_null_terminated. */
-    buffer_length = strlen(value) + sizeof("");
-
-    return cJSON_ParseWithLengthOpts(value, buffer_length, return_parse_end, require_null_terminated);
+    if (item->type & cJSON_IsLazy)
+    {
+        lazy_expand((cJSON*)item);
+    }
+    return item->child;
 }
 
-/* Parse an object - create a new root, and populate. */
-CJSON_PUBLIC(cJSON *) cJSON_ParseWithLengthOpts(const char *value, size_t buffer_length, const char **return_parse_end, cJSON_bool require_null_terminated)
+CJSON_PUBLIC(cJSON *) cJSON_ParseLazy(cJSON_Arena *arena, const char *value, size_t buffer_length)
 {
-    parse_buffer buffer = { 0, 0, 0, 0, { 0, 0, 0 } };
+    lazy_document *doc = NULL;
+    unsigned char *content = NULL;
     cJSON *item = NULL;
+    size_t start = 0;
 
-    /* reset error position */
-    global_error.json = NULL;
-    global_error.position = 0;
-
-    if (value == NULL || 0 == buffer_length)
+    if ((arena == NULL) || (value == NULL) || (buffer_length == 0))
     {
-        goto fail;
+        return NULL;
     }
 
-    buffer.content = (const unsigned char*)value;
-    buffer.length = buffer_length; 
-    buffer.offset = 0;
-    buffer.hooks = global_hooks;
-
-    item = cJSON_New_Item(&global_hooks);
-    if (item == NULL) /* memory fail */
+    /* Only arrays and objects can be lazy. */
+    while ((start < buffer_length) && ((unsigned char)value[start] <= 32) && (value[start] != '\0'))
     {
-        goto fail;
+        start++;
     }
-
-    if (!parse_value(item, buffer_skip_whitespace(skip_utf8_bom(&buffer))))
+    if ((start == buffer_length) || ((value[start] != '{') && (value[start] != '[')))
     {
-        /* parse failure. ep is set. */
-        goto fail;
+        return cJSON_ParseArena(arena, value, buffer_length);
     }
 
-    /* if we require null-terminated JSON without appended garbage, skip and then check for a null terminator */
-    if (require_null_terminated)
+    doc = (lazy_document*)arena_allocate(arena, sizeof(lazy_document));
+    content = (unsigned char*)arena_allocate(arena, buffer_length + 1);
+    if ((doc == NULL) || (content == NULL))
     {
-        buffer_skip_whitespace(&buffer);
-        if ((buffer.offset >= buffer.length) || buffer_at_offset(&buffer)[0] != '\0')
-        {
-            goto fail;
-        }
+        return NULL;
     }
-    if (return_parse_end)
+    memcpy(content, value, buffer_length);
+    content[buffer_length] = '\0';
+    doc->arena = arena;
+    doc->content = content;
+    doc->length = buffer_length;
+    doc->containers = NULL;
+    doc->count = 0;
+    doc->error = false;
+    if (!lazy_index(doc, start))
     {
-        *return_parse_end = (const char*)buffer_at_offset(&buffer);
+        return NULL;
     }
 
+    item = &doc->root;
+    memset(item, '\0', sizeof(cJSON));
+    lazy_init(item, doc, 0);
     return item;
+}
 
-fail:
-    if (item != NULL)
+CJSON_PUBLIC(cJSON_bool) cJSON_LazyError(const cJSON *root)
+{
+    if (root == NULL)
     {
-        cJSON_Delete(item);
+        return true;
     }
-
-    if (value != NULL)
+    /* Scalar documents are parsed upfront by cJSON_ParseArena(), while an
+     * array/object root is always the first member of its document, even
+     * after expanding it or after a failed expansion made it invalid. */
+    switch (root->type & 0xFF)
     {
-        error local_error;
-        local_error.json = (const unsigned char*)value;
-        local_error.position = 0;
-
-        if (buffer.offset < buffer.length)
-        {
-            local_error.position = buffer.offset;
-        }
-        else if (buffer.length > 0)
-        {
-            local_error.position = buffer.length - 1;
-        }
-
-        if (return_parse_end != NULL)
-        {
-            *return_parse_end = (const char*)local_error.json + local_error.position;
-        }
+        case cJSON_Array:
+        case cJSON_Object:
+        case cJSON_Invalid:
+            return ((const lazy_document*)(const void*)root)->error;
 
-        global_error = local_error;
+        default:
+            return false;
     }
-
-    return NULL;
 }
 
 /* Default options for cJSON_Parse */
@@ -1369,6 +2345,13 @@ static cJSON_bool print_value(const cJSON * const item, printbuffer * const outp
         return false;
     }
 
+    /* Expand before looking at the type: a failed expansion makes the
+     * item invalid, and printing fails instead of emitting it empty. */
+    if (item->type & cJSON_IsLazy)
+    {
+        lazy_expand((cJSON*)item);
+    }
+
     switch ((item->type) & 0xFF)
     {
         case cJSON_NULL:
@@ -1472,7 +2455,7 @@ static cJSON_bool parse_array(cJSON * const item, parse_buffer * const input_buf
     do
     {
         /* allocate next item */
-        cJSON *new_item = cJSON_New_Item(&(input_buffer->hooks));
+        cJSON *new_item = parse_new_item(input_buffer);
         if (new_item == NULL)
         {
             goto fail; /* allocation failure */
@@ -1499,6 +2482,7 @@ static cJSON_bool parse_array(cJSON * const item, parse_buffer * const input_buf
         {
             goto fail; /* failed to parse value */
         }
+        parse_flag(input_buffer, current_item);
         buffer_skip_whitespace(input_buffer);
     }
     while (can_access_at_index(input_buffer, 0) && (buffer_at_offset(input_buffer)[0] == ','));
@@ -1525,7 +2509,7 @@ success:
 fail:
     if (head != NULL)
     {
-        cJSON_Delete(head);
+        parse_delete(input_buffer, head);
     }
 
     return false;
@@ -1536,7 +2520,7 @@ static cJSON_bool print_array(const cJSON * const item, printbuffer * const outp
 {
     unsigned char *output_pointer = NULL;
     size_t length = 0;
-    cJSON *current_element = item->child;
+    cJSON *current_element = cJSON_GetChild(item);
 
     if (output_buffer == NULL)
     {
@@ -1630,7 +2614,7 @@ static cJSON_bool parse_object(cJSON * const item, parse_buffer * const input_bu
     do
     {
         /* allocate next item */
-        cJSON *new_item = cJSON_New_Item(&(input_buffer->hooks));
+        cJSON *new_item = parse_new_item(input_buffer);
         if (new_item == NULL)
         {
             goto fail; /* allocation failure */
@@ -1675,6 +2659,7 @@ static cJSON_bool parse_object(cJSON * const item, parse_buffer * const input_bu
         {
             goto fail; /* failed to parse value */
         }
+        parse_flag(input_buffer, current_item);
         buffer_skip_whitespace(input_buffer);
     }
     while (can_access_at_index(input_buffer, 0) && (buffer_at_offset(input_buffer)[0] == ','));
@@ -1700,7 +2685,7 @@ success:
 fail:
     if (head != NULL)
     {
-        cJSON_Delete(head);
+        parse_delete(input_buffer, head);
     }
 
     return false;
@@ -1711,7 +2696,7 @@ static cJSON_bool print_object(const cJSON * const item, printbuffer * const out
 {
     unsigned char *output_pointer = NULL;
     size_t length = 0;
-    cJSON *current_item = item->child;
+    cJSON *current_item = cJSON_GetChild(item);
 
     if (output_buffer == NULL)
     {
@@ -1820,6 +2805,231 @@ static cJSON_bool print_object(const cJSON * const item, printbuffer * const out
     return true;
 }
 
+/* Lookup indexes.
+ *
+ * Looking up a key is a linear scan of the children list. Objects with many
+ * keys that are looked up many times (like symbol maps returned by some
+ * API) can get a hash table of their children calling cJSON_BuildIndex().
+ * The index is an open addressing table with linear probing, hashing the
+ * keys case insensitively so that it serves both kinds of lookups.
+ * Children are inserted in list order, so the probe sequence meets keys
+ * that compare equal in list order as well, and the first match is the
+ * same one the linear scan would return. The index is dropped by every
+ * function modifying the object.
+ *
+ * Similarly, accessing an array item by position walks the list, so
+ * iterating an array by index is quadratic. cJSON_BuildIndex() called on
+ * an array builds a vector of the array items instead. Unlike the objects
+ * index, the vector is kept up to date by the functions adding, removing
+ * or replacing array items, since arrays are often built by appending to
+ * them while reading them back.
+ *
+ * Indexes are only built on request, never by the lookups themselves, so
+ * that lookups don't modify the item: a tree can still be read by multiple
+ * threads at the same time, as long as nobody modifies it. */
+typedef struct
+{
+    size_t mask; /* Number of slots minus one. */
+    cJSON *slots[];
+} object_index;
+
+static size_t index_hash(const unsigned char *key)
+{
+    size_t hash = 5381;
+    while (*key != '\0')
+    {
+        hash = (hash * 33) ^ (size_t)tolower(*key);
+        key++;
+    }
+    return hash;
+}
+
+CJSON_PUBLIC(void) cJSON_InvalidateIndex(cJSON *item)
+{
+    if ((item == NULL) || (item->type & cJSON_IsLazy))
+    {
+        return;
+    }
+    if (item->index != NULL)
+    {
+        global_hooks.deallocate(item->index);
+        item->index = NULL;
+    }
+}
+
+/* Build the index of the object. Objects having items without a key are
+ * not indexed. */
+static void build_object_index(cJSON *object)
+{
+    size_t count = 0;
+    size_t slots = 1;
+    cJSON *child = NULL;
+    object_index *index = NULL;
+
+    for (child = object->child; child != NULL; child = child->next)
+    {
+        if (child->string == NULL)
+        {
+            return;
+        }
+        count++;
+    }
+
+    /* At most half full, so that probe sequences are short. */
+    while (slots < count * 2)
+    {
+        slots *= 2;
+    }
+    index = (object_index*)global_hooks.allocate(sizeof(object_index) + sizeof(cJSON*) * slots);
+    if (index == NULL)
+    {
+        return;
+    }
+    memset(index->slots, '\0', sizeof(cJSON*) * slots);
+    index->mask = slots - 1;
+    for (child = object->child; child != NULL; child = child->next)
+    {
+        size_t i = index_hash((const unsigned char*)child->string) & index->mask;
+        while (index->slots[i] != NULL)
+        {
+            i = (i + 1) & index->mask;
+        }
+        index->slots[i] = child;
+    }
+    object->index = index;
+}
+
+static cJSON *index_lookup(const object_index *index, const char * const name, const cJSON_bool case_sensitive)
+{
+    size_t i = index_hash((const unsigned char*)name) & index->mask;
+    while (index->slots[i] != NULL)
+    {
+        cJSON *current_element = index->slots[i];
+        if (case_sensitive ? (strcmp(name, current_element->string) == 0) : (case_insensitive_strcmp((const unsigned char*)name, (const unsigned char*)current_element->string) == 0))
+        {
+            return current_element;
+        }
+        i = (i + 1) & index->mask;
+    }
+    return NULL;
+}
+
+typedef struct
+{
+    size_t count; /* Number of items. */
+    size_t alloc; /* Allocated slots. */
+    cJSON *items[];
+} array_index;
+
+static cJSON_bool has_array_index(const cJSON *item)
+{
+    return (item->index != NULL) && ((item->type & (0xFF | cJSON_IsLazy)) == cJSON_Array);
+}
+
+static void build_array_index(cJSON *array)
+{
+    size_t count = 0;
+    cJSON *child = NULL;
+    array_index *index = NULL;
+
+    for (child = array->child; child != NULL; child = child->next)
+    {
+        count++;
+    }
+    index = (array_index*)global_hooks.allocate(sizeof(array_index) + sizeof(cJSON*) * count);
+    if (index == NULL)
+    {
+        return;
+    }
+    index->count = 0;
+    index->alloc = count;
+    for (child = array->child; child != NULL; child = child->next)
+    {
+        index->items[index->count++] = child;
+    }
+    array->index = index;
+}
+
+/* Make room for one more item in the array vector. On out of memory the
+ * vector is dropped, and lookups go back to walking the list. */
+static array_index *array_index_reserve(cJSON *array)
+{
+    array_index *index = (array_index*)array->index;
+    array_index *bigger = NULL;
+    size_t alloc = 0;
+
+    if (index->count < index->alloc)
+    {
+        return index;
+    }
+    alloc = (index->alloc < 16) ? 16 : index->alloc * 2;
+    bigger = (array_index*)global_hooks.allocate(sizeof(array_index) + sizeof(cJSON*) * alloc);
+    if (bigger == NULL)
+    {
+        cJSON_InvalidateIndex(array);
+        return NULL;
+    }
+    memcpy(bigger, index, sizeof(array_index) + sizeof(cJSON*) * index->count);
+    bigger->alloc = alloc;
+    global_hooks.deallocate(index);
+    array->index = bigger;
+    return bigger;
+}
+
+static void array_index_insert(cJSON *array, size_t position, cJSON *item)
+{
+    array_index *index = array_index_reserve(array);
+    if (index == NULL)
+    {
+        return;
+    }
+    memmove(index->items + position + 1, index->items + position, sizeof(cJSON*) * (index->count - position));
+    index->items[position] = item;
+    index->count++;
+}
+
+/* Return the position of 'item' in the array vector. Removing the last or
+ * the first item are the common cases, so they are checked first. */
+static size_t array_index_find(const array_index *index, const cJSON *item)
+{
+    size_t position = 0;
+    if ((index->count > 0) && (index->items[index->count - 1] == item))
+    {
+        return index->count - 1;
+    }
+    while ((position < index->count) && (index->items[position] != item))
+    {
+        position++;
+    }
+    return position;
+}
+
+static void array_index_remove(cJSON *array, const cJSON *item)
+{
+    array_index *index = (array_index*)array->index;
+    size_t position = array_index_find(index, item);
+    if (position == index->count)
+    {
+        /* Out of sync, should never happen. */
+        cJSON_InvalidateIndex(array);
+        return;
+    }
+    memmove(index->items + position, index->items + position + 1, sizeof(cJSON*) * (index->count - position - 1));
+    index->count--;
+}
+
+static void array_index_replace(cJSON *array, const cJSON *item, cJSON *replacement)
+{
+    array_index *index = (array_index*)array->index;
+    size_t position = array_index_find(index, item);
+    if (position == index->count)
+    {
+        cJSON_InvalidateIndex(array);
+        return;
+    }
+    index->items[position] = replacement;
+}
+
 /* Get Array size/item / object item. */
 CJSON_PUBLIC(int) cJSON_GetArraySize(const cJSON *array)
 {
@@ -1831,6 +3041,15 @@ CJSON_PUBLIC(int) cJSON_GetArraySize(const cJSON *array)
         return 0;
     }
 
+    if (array->type & cJSON_IsLazy)
+    {
+        lazy_expand((cJSON*)array);
+    }
+    if (has_array_index(array))
+    {
+        return (int)((const array_index*)array->index)->count;
+    }
+
     child = array->child;
 
     while(child != NULL)
@@ -1853,6 +3072,16 @@ static cJSON* get_array_item(const cJSON *array, size_t index)
         return NULL;
     }
 
+    if (array->type & cJSON_IsLazy)
+    {
+        lazy_expand((cJSON*)array);
+    }
+    if (has_array_index(array))
+    {
+        const array_index *vector = (const array_index*)array->index;
+        return (index < vector->count) ? vector->items[index] : NULL;
+    }
+
     current_child = array->child;
     while ((current_child != NULL) && (index > 0))
     {
@@ -1882,6 +3111,15 @@ static cJSON *get_object_item(const cJSON * const object, const char * const nam
         return NULL;
     }
 
+    if (object->type & cJSON_IsLazy)
+    {
+        lazy_expand((cJSON*)object);
+    }
+    if ((object->index != NULL) && ((object->type & (0xFF | cJSON_IsLazy)) == cJSON_Object))
+    {
+        return index_lookup((const object_index*)object->index, name, case_sensitive);
+    }
+
     current_element = object->child;
     if (case_sensitive)
     {
@@ -1905,6 +3143,32 @@ static cJSON *get_object_item(const cJSON * const object, const char * const nam
     return current_element;
 }
 
+CJSON_PUBLIC(cJSON_bool) cJSON_BuildIndex(cJSON *item)
+{
+    /* Arena items are never freed one by one, so they can't own an
+     * index. */
+    if ((item == NULL) || (item->type & cJSON_InArena))
+    {
+        return false;
+    }
+    if (item->type & cJSON_IsLazy)
+    {
+        lazy_expand(item);
+    }
+    if (item->index == NULL)
+    {
+        if ((item->type & 0xFF) == cJSON_Object)
+        {
+            build_object_index(item);
+        }
+        else if ((item->type & 0xFF) == cJSON_Array)
+        {
+            build_array_index(item);
+        }
+    }
+    return item->index != NULL;
+}
+
 CJSON_PUBLIC(cJSON *) cJSON_GetObjectItem(const cJSON * const object, const char * const string)
 {
     return get_object_item(object, string, false);
@@ -1942,9 +3206,12 @@ static cJSON *create_reference(const cJSON *item, const internal_hooks * const h
         return NULL;
     }
 
+    cJSON_GetChild(item); /* The reference shares the children. */
     memcpy(reference, item, sizeof(cJSON));
     reference->string = NULL;
+    reference->index = NULL;
     reference->type |= cJSON_IsReference;
+    reference->type &= ~cJSON_InArena;
     reference->next = reference->prev = NULL;
     return reference;
 }
@@ -1958,6 +3225,15 @@ static cJSON_bool add_item_to_array(cJSON *array, cJSON *item)
         return false;
     }
 
+    cJSON_GetChild(array); /* Expand lazy items before appending. */
+    if (has_array_index(array))
+    {
+        array_index_insert(array, ((array_index*)array->index)->count, item);
+    }
+    else
+    {
+        cJSON_InvalidateIndex(array);
+    }
     child = array->child;
     /*
      * To find the last item in array quickly, we use prev in array
@@ -2030,7 +3306,7 @@ static cJSON_bool add_item_to_object(cJSON * const object, const char * const st
         new_type = item->type & ~cJSON_StringIsConst;
     }
 
-    if (!(item->type & cJSON_StringIsConst) && (item->string != NULL))
+    if (!(item->type & (cJSON_StringIsConst | cJSON_InArena)) && (item->string != NULL))
     {
         hooks->deallocate(item->string);
     }
@@ -2187,6 +3463,14 @@ CJSON_PUBLIC(cJSON *) cJSON_DetachItemViaPointer(cJSON *parent, cJSON * const it
         return NULL;
     }
 
+    if (has_array_index(parent))
+    {
+        array_index_remove(parent, item);
+    }
+    else
+    {
+        cJSON_InvalidateIndex(parent);
+    }
     if (item != parent->child)
     {
         /* not the first element */
@@ -2271,6 +3555,14 @@ CJSON_PUBLIC(cJSON_bool) cJSON_InsertItemInArray(cJSON *array, int which, cJSON
         return add_item_to_array(array, newitem);
     }
 
+    if (has_array_index(array))
+    {
+        array_index_insert(array, (size_t)which, newitem);
+    }
+    else
+    {
+        cJSON_InvalidateIndex(array);
+    }
     newitem->next = after_inserted;
     newitem->prev = after_inserted->prev;
     after_inserted->prev = newitem;
@@ -2297,6 +3589,14 @@ CJSON_PUBLIC(cJSON_bool) cJSON_ReplaceItemViaPointer(cJSON * const parent, cJSON
         return true;
     }
 
+    if (has_array_index(parent))
+    {
+        array_index_replace(parent, item, replacement);
+    }
+    else
+    {
+        cJSON_InvalidateIndex(parent);
+    }
     replacement->next = item->next;
     replacement->prev = item->prev;
 
@@ -2352,7 +3652,7 @@ static cJSON_bool replace_item_in_object(cJSON *object, const char *string, cJSO
     }
 
     /* replace the name in the replacement */
-    if (!(replacement->type & cJSON_StringIsConst) && (replacement->string != NULL))
+    if (!(replacement->type & (cJSON_StringIsConst | cJSON_InArena)) && (replacement->string != NULL))
     {
         cJSON_free(replacement->string);
     }
@@ -2426,18 +3726,21 @@ CJSON_PUBLIC(cJSON *) cJSON_CreateNumber(double num)
         item->valuedouble = num;
 
         /* use saturation in case of overflow */
-        if (num >= INT_MAX)
-        {
-            item->valueint = INT_MAX;
-        }
-        else if (num <= (double)INT_MIN)
-        {
-            item->valueint = INT_MIN;
-        }
-        else
-        {
-            item->valueint = (int)num;
-        }
+        set_number_ints(item, num);
+    }
+
+    return item;
+}
+
+CJSON_PUBLIC(cJSON *) cJSON_CreateInt64(int64_t num)
+{
+    cJSON *item = cJSON_New_Item(&global_hooks);
+    if(item)
+    {
+        item->type = cJSON_Number;
+        item->valuedouble = (double)num;
+        set_number_ints(item, (double)num);
+        item->valueint64 = num;
     }
 
     return item;
@@ -2713,8 +4016,9 @@ CJSON_PUBLIC(cJSON *) cJSON_Duplicate(const cJSON *item, cJSON_bool recurse)
         goto fail;
     }
     /* Copy over all vars */
-    newitem->type = item->type & (~cJSON_IsReference);
+    newitem->type = item->type & (~(cJSON_IsReference | cJSON_InArena | cJSON_IsLazy));
     newitem->valueint = item->valueint;
+    newitem->valueint64 = item->valueint64;
     newitem->valuedouble = item->valuedouble;
     if (item->valuestring)
     {
@@ -2737,6 +4041,7 @@ CJSON_PUBLIC(cJSON *) cJSON_Duplicate(const cJSON *item, cJSON_bool recurse)
     {
         return newitem;
     }
+    cJSON_GetChild(item); /* Expand lazy items. */
     /* Walk the ->next chain for the child. */
     child = item->child;
     while (child != NULL)
@@ -2980,6 +4285,8 @@ CJSON_PUBLIC(cJSON_bool) cJSON_Compare(const cJSON * const a, const cJSON * cons
     {
         return false;
     }
+    cJSON_GetChild(a); /* Expand lazy items. */
+    cJSON_GetChild(b);
 
     /* check if type is valid */
     switch (a->type & 0xFF)
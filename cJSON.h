@@ -84,6 +84,8 @@ then using the CJSON_API_VISIBILITY flag to "export" the same symbols the way CJ
 #define CJSON_VERSION_PATCH 14
 
 #include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 
 /* cJSON Types: */
 #define cJSON_Invalid (0)
@@ -98,6 +100,8 @@ then using the CJSON_API_VISIBILITY flag to "export" the same symbols the way CJ
 
 #define cJSON_IsReference 256
 #define cJSON_StringIsConst 512
+#define cJSON_InArena 1024 /* Allocated by cJSON_ParseArena(). */
+#define cJSON_IsLazy 2048 /* Not yet expanded, see cJSON_ParseLazy(). */
 
 /* The cJSON structure: */
 typedef struct cJSON
@@ -117,9 +121,21 @@ typedef struct cJSON
     int valueint;
     /* The item's number, if type==cJSON_Number */
     double valuedouble;
+    /* The item's number as a 64 bit integer, exact for integers parsed
+     * from the JSON text even above 2^53, saturated/truncated otherwise. */
+    int64_t valueint64;
 
     /* The item's name string, if this item is the child of, or is in the list of subitems of an object. */
     char *string;
+
+    /* Lookup index of an array/object, built by cJSON_BuildIndex(), and
+     * updated or dropped when the array/object is modified via the cJSON
+     * API. Don't touch it, and if you modify the child list or the keys
+     * directly, call cJSON_InvalidateIndex() on the parent. Lazy items
+     * (cJSON_IsLazy) use it to reference their source document instead. */
+    void *index;
+    /* Number of the container of a lazy item in its source document. */
+    unsigned int lazy_container;
 } cJSON;
 
 typedef struct cJSON_Hooks
@@ -129,6 +145,9 @@ typedef struct cJSON_Hooks
       void (CJSON_CDECL *free_fn)(void *ptr);
 } cJSON_Hooks;
 
+/* Bump allocator for parse trees, see cJSON_ParseArena(). */
+typedef struct cJSON_Arena cJSON_Arena;
+
 typedef int cJSON_bool;
 
 /* Limits how deeply nested arrays/objects can be before cJSON rejects to parse them.
@@ -151,6 +170,32 @@ CJSON_PUBLIC(cJSON *) cJSON_ParseWithLength(const char *value, size_t buffer_len
 /* If you supply a ptr in return_parse_end and parsing fails, then return_parse_end will contain a pointer to the error so will match cJSON_GetErrorPtr(). */
 CJSON_PUBLIC(cJSON *) cJSON_ParseWithOpts(const char *value, const char **return_parse_end, cJSON_bool require_null_terminated);
 CJSON_PUBLIC(cJSON *) cJSON_ParseWithLengthOpts(const char *value, size_t buffer_length, const char **return_parse_end, cJSON_bool require_null_terminated);
+/* Parse placing all the nodes and strings into 'arena'. The returned tree is
+ * valid until the arena is reset or deleted: cJSON_Delete() does nothing on
+ * it. Arena items are flagged cJSON_InArena, are never indexed, and should
+ * not be moved into heap allocated trees (nor heap items into them) unless
+ * detached again before the arena is reset. cJSON_SetValuestring() fails on
+ * them if the new string is longer than the old one. A size of 0 means the
+ * default chunk size. */
+CJSON_PUBLIC(cJSON_Arena *) cJSON_ArenaCreate(size_t size);
+CJSON_PUBLIC(void) cJSON_ArenaReset(cJSON_Arena *arena);
+CJSON_PUBLIC(void) cJSON_ArenaDelete(cJSON_Arena *arena);
+CJSON_PUBLIC(cJSON *) cJSON_ParseArena(cJSON_Arena *arena, const char *value, size_t buffer_length);
+/* Like cJSON_ParseArena(), but only the structure of the document is
+ * validated and indexed: the children of an array/object are parsed the
+ * first time they are accessed via the cJSON API (lookups, selectors,
+ * cJSON_ArrayForEach(), printing, ...). Until then, the array/object is
+ * flagged cJSON_IsLazy and its 'child' pointer is NULL: code accessing the
+ * children directly must use cJSON_GetChild(). A syntax error found while
+ * expanding an array/object turns it into an empty cJSON_Invalid item, and
+ * is reported by cJSON_LazyError(). The input is copied into the arena. */
+CJSON_PUBLIC(cJSON *) cJSON_ParseLazy(cJSON_Arena *arena, const char *value, size_t buffer_length);
+/* Return true if expanding some array/object of the document failed so far,
+ * or if 'root' is NULL. Call it after reading what you need from the tree:
+ * 'root' must be the item returned by cJSON_ParseLazy(). */
+CJSON_PUBLIC(cJSON_bool) cJSON_LazyError(const cJSON *root);
+/* Return the first child of an array/object, expanding it if lazy. */
+CJSON_PUBLIC(cJSON *) cJSON_GetChild(const cJSON *item);
 
 /* Render a cJSON entity to text for transfer/storage. */
 CJSON_PUBLIC(char *) cJSON_Print(const cJSON *item);
@@ -172,12 +217,22 @@ CJSON_PUBLIC(cJSON *) cJSON_GetArrayItem(const cJSON *array, int index);
 CJSON_PUBLIC(cJSON *) cJSON_GetObjectItem(const cJSON * const object, const char * const string);
 CJSON_PUBLIC(cJSON *) cJSON_GetObjectItemCaseSensitive(const cJSON * const object, const char * const string);
 CJSON_PUBLIC(cJSON_bool) cJSON_HasObjectItem(const cJSON *object, const char *string);
+/* Build a lookup index for an object (a hash table of its keys) or an
+ * array (a vector of its items), so that lookups by key or position no
+ * longer scan the children. Worth it only for big objects/arrays looked
+ * up many times. Arrays keep the index while modified via the cJSON API,
+ * objects drop it. Returns false if the item can't be indexed. */
+CJSON_PUBLIC(cJSON_bool) cJSON_BuildIndex(cJSON *item);
+/* Drop the lookup index of an array/object after modifying it directly. */
+CJSON_PUBLIC(void) cJSON_InvalidateIndex(cJSON *item);
 /* For analysing failed parses. This returns a pointer to the parse error. You'll probably need to look a few chars back to make sense of it. Defined when cJSON_Parse() returns 0. 0 when cJSON_Parse() succeeds. */
 CJSON_PUBLIC(const char *) cJSON_GetErrorPtr(void);
 
 /* Check item type and return its value */
 CJSON_PUBLIC(char *) cJSON_GetStringValue(const cJSON * const item);
 CJSON_PUBLIC(double) cJSON_GetNumberValue(const cJSON * const item);
+/* Return the number as a 64 bit integer, or 0 if the item is not a number. */
+CJSON_PUBLIC(int64_t) cJSON_GetInt64(const cJSON * const item);
 
 /* These functions check the type of an item */
 CJSON_PUBLIC(cJSON_bool) cJSON_IsInvalid(const cJSON * const item);
@@ -197,6 +252,8 @@ CJSON_PUBLIC(cJSON *) cJSON_CreateTrue(void);
 CJSON_PUBLIC(cJSON *) cJSON_CreateFalse(void);
 CJSON_PUBLIC(cJSON *) cJSON_CreateBool(cJSON_bool boolean);
 CJSON_PUBLIC(cJSON *) cJSON_CreateNumber(double num);
+/* Create a number holding exactly 'num', even above 2^53. */
+CJSON_PUBLIC(cJSON *) cJSON_CreateInt64(int64_t num);
 CJSON_PUBLIC(cJSON *) cJSON_CreateString(const char *string);
 /* raw json */
 CJSON_PUBLIC(cJSON *) cJSON_CreateRaw(const char *raw);
@@ -271,8 +328,15 @@ CJSON_PUBLIC(cJSON*) cJSON_AddRawToObject(cJSON * const object, const char * con
 CJSON_PUBLIC(cJSON*) cJSON_AddObjectToObject(cJSON * const object, const char * const name);
 CJSON_PUBLIC(cJSON*) cJSON_AddArrayToObject(cJSON * const object, const char * const name);
 
-/* When assigning an integer value, it needs to be propagated to valuedouble too. */
-#define cJSON_SetIntValue(object, number) ((object) ? (object)->valueint = (object)->valuedouble = (number) : (number))
+/* When assigning an integer value, it needs to be propagated to valuedouble too.
+ * valueint64 is assigned first, so that it is exact, and valueint saturates
+ * like it does for parsed numbers. */
+#define cJSON_SetIntValue(object, number) ((object) ? \
+    ((object)->valueint64 = (int64_t)(number), \
+     (object)->valuedouble = (double)(object)->valueint64, \
+     (object)->valueint = ((object)->valueint64 > INT_MAX) ? INT_MAX : \
+                          ((object)->valueint64 < INT_MIN) ? INT_MIN : \
+                          (int)(object)->valueint64) : (number))
 /* helper for the cJSON_SetNumberValue macro */
 CJSON_PUBLIC(double) cJSON_SetNumberHelper(cJSON *object, double number);
 #define cJSON_SetNumberValue(object, number) ((object != NULL) ? cJSON_SetNumberHelper(object, (double)number) : (number))
@@ -280,7 +344,7 @@ CJSON_PUBLIC(double) cJSON_SetNumberHelper(cJSON *object, double number);
 CJSON_PUBLIC(char*) cJSON_SetValuestring(cJSON *object, const char *valuestring);
 
 /* Macro for iterating over an array or object */
-#define cJSON_ArrayForEach(element, array) for(element = (array != NULL) ? (array)->child : NULL; element != NULL; element = element->next)
+#define cJSON_ArrayForEach(element, array) for(element = (array != NULL) ? cJSON_GetChild(array) : NULL; element != NULL; element = element->next)
 
 /* malloc/free objects using the malloc/free functions that have been set with cJSON_InitHooks */
 CJSON_PUBLIC(void *) cJSON_malloc(size_t size);
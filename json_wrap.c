@@ -6,7 +6,11 @@
 #include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <locale.h>
 #include "cJSON.h"
+#include "botlib.h"
 
 /* You can select things like this:
  *
@@ -47,6 +51,19 @@
 #define JSEL_ARRAY 2          /* "[" */
 #define JSEL_TYPECHECK 3      /* ":" */
 #define JSEL_MAX_TOKEN 256
+
+/* Return 1 if the object 'o' is of the type specified by the ":<type>"
+ * selector letter 't', otherwise 0. */
+static int jselTypeCheck(cJSON *o, char t) {
+    if (t == 's' && !cJSON_IsString(o)) return 0;
+    if (t == 'n' && !cJSON_IsNumber(o)) return 0;
+    if (t == 'o' && !cJSON_IsObject(o)) return 0;
+    if (t == 'a' && !cJSON_IsArray(o)) return 0;
+    if (t == 'b' && !cJSON_IsBool(o)) return 0;
+    if (t == '!' && !cJSON_IsNull(o)) return 0;
+    return 1;
+}
+
 cJSON *cJSON_Select(cJSON *o, const char *fmt, ...) {
     int next = JSEL_INVALID;        /* Type of the next selector. */
     char token[JSEL_MAX_TOKEN+1];   /* Current token. */
@@ -73,12 +90,7 @@ cJSON *cJSON_Select(cJSON *o, const char *fmt, ...) {
                 if ((o = cJSON_GetObjectItemCaseSensitive(o,token)) == NULL)
                     goto notfound;
             } else if (next == JSEL_TYPECHECK) {
-                if (token[0] == 's' && !cJSON_IsString(o)) goto notfound;
-                if (token[0] == 'n' && !cJSON_IsNumber(o)) goto notfound;
-                if (token[0] == 'o' && !cJSON_IsObject(o)) goto notfound;
-                if (token[0] == 'a' && !cJSON_IsArray(o)) goto notfound;
-                if (token[0] == 'b' && !cJSON_IsBool(o)) goto notfound;
-                if (token[0] == '!' && !cJSON_IsNull(o)) goto notfound;
+                if (!jselTypeCheck(o,token[0])) goto notfound;
             }
         } else if (next != JSEL_INVALID) {
             /* Otherwise accumulate characters in the current token, note that
@@ -138,3 +150,543 @@ notfound:
     o = NULL;
     goto cleanup;
 }
+
+/* Compiled selectors.
+ *
+ * cJSON_Select() parses the selector at every call. Code selecting the
+ * same paths again and again (like the bot processing every update) can
+ * instead compile the selector once with cJSON_SelectCompile(), and then
+ * evaluate it any number of times with cJSON_SelectCompiled(), that just
+ * walks the array of steps:
+ *
+ *  cJSON_Selector *sel = cJSON_SelectCompile(".features.screens[*].width");
+ *  cJSON *width = cJSON_SelectCompiled(json,sel,4);
+ *
+ * The syntax is the same of cJSON_Select(), and "*" placeholders remain
+ * parameter slots, filled from the arguments at every evaluation. Empty
+ * tokens (like in "..a" or ".a[]") are ignored. A compiled selector is
+ * never modified by the evaluation, so it can be shared among threads. */
+typedef struct jselStep {
+    int type;           /* JSEL_OBJ, JSEL_ARRAY or JSEL_TYPECHECK. */
+    char *token;        /* Field name / index / type, '*' for params. */
+    int params;         /* Number of '*' placeholders in the token. */
+    int index;          /* Array index, if JSEL_ARRAY without params. */
+} jselStep;
+
+struct cJSON_Selector {
+    int numsteps;
+    jselStep steps[];
+};
+
+/* Compile the selector. Returns NULL if the selector is invalid (in such
+ * case cJSON_Select() would always return NULL). The returned selector
+ * should be freed with cJSON_SelectFree(). */
+cJSON_Selector *cJSON_SelectCompile(const char *fmt) {
+    /* Every step starts with a separator, so this is an upper bound. */
+    int maxsteps = 0;
+    for (const char *p = fmt; *p; p++) if (strchr(".[:",*p)) maxsteps++;
+
+    cJSON_Selector *sel = malloc(sizeof(*sel)+sizeof(jselStep)*maxsteps);
+    if (sel == NULL) return NULL;
+    sel->numsteps = 0;
+
+    const char *p = fmt;
+    while(*p) {
+        int type;
+        /* Skip closing "]", just useless syntax like in cJSON_Select(). */
+        if (*p == ']') {
+            p++;
+            continue;
+        }
+        if (*p == '.') type = JSEL_OBJ;
+        else if (*p == '[') type = JSEL_ARRAY;
+        else if (*p == ':') type = JSEL_TYPECHECK;
+        else goto invalid;
+
+        const char *start = ++p;
+        while(*p && !strchr(".[]:",*p)) p++;
+        size_t len = p-start;
+        if (len == 0) continue;
+        if (len > JSEL_MAX_TOKEN) goto invalid;
+
+        jselStep *step = sel->steps+sel->numsteps;
+        step->type = type;
+        step->params = 0;
+        for (size_t j = 0; j < len; j++) if (start[j] == '*') step->params++;
+        if (type == JSEL_TYPECHECK && step->params) goto invalid;
+        step->token = malloc(len+1);
+        if (step->token == NULL) goto invalid;
+        memcpy(step->token,start,len);
+        step->token[len] = '\0';
+        step->index = type == JSEL_ARRAY ? atoi(step->token) : 0;
+        sel->numsteps++;
+    }
+    return sel;
+
+invalid:
+    cJSON_SelectFree(sel);
+    return NULL;
+}
+
+void cJSON_SelectFree(cJSON_Selector *sel) {
+    if (sel == NULL) return;
+    for (int j = 0; j < sel->numsteps; j++) free(sel->steps[j].token);
+    free(sel);
+}
+
+/* Replace the '*' placeholders of the token with the arguments, exactly
+ * like cJSON_Select() does: integers in the context of arrays, strings
+ * in the context of objects. Return 0 if the result does not fit. */
+static int jselExpand(const jselStep *step, char *buf, va_list *ap) {
+    size_t tlen = 0;
+    for (const char *p = step->token; *p; p++) {
+        char num[64];
+        const char *s = p;
+        size_t len = 1;
+        if (*p == '*') {
+            if (step->type == JSEL_ARRAY) {
+                len = snprintf(num,sizeof(num),"%d",va_arg(*ap,int));
+                s = num;
+            } else {
+                s = va_arg(*ap,char*);
+                len = strlen(s);
+            }
+        }
+        if (tlen+len > JSEL_MAX_TOKEN) return 0;
+        memcpy(buf+tlen,s,len);
+        tlen += len;
+    }
+    buf[tlen] = '\0';
+    return 1;
+}
+
+/* Like cJSON_SelectCompiled() but takes a va_list. Note that the
+ * va_list is passed by pointer so that callers can evaluate multiple
+ * selectors consuming the same arguments list. */
+cJSON *cJSON_SelectCompiledV(cJSON *o, const cJSON_Selector *sel, va_list *ap) {
+    char buf[JSEL_MAX_TOKEN+1];
+    if (sel == NULL) return NULL;
+    for (int j = 0; j < sel->numsteps && o; j++) {
+        const jselStep *step = sel->steps+j;
+        const char *token = step->token;
+        if (step->params) {
+            if (!jselExpand(step,buf,ap)) return NULL;
+            token = buf;
+        }
+        if (step->type == JSEL_ARRAY) {
+            if (!cJSON_IsArray(o)) return NULL;
+            o = cJSON_GetArrayItem(o,step->params ? atoi(token) : step->index);
+        } else if (step->type == JSEL_OBJ) {
+            if (!cJSON_IsObject(o)) return NULL;
+            o = cJSON_GetObjectItemCaseSensitive(o,token);
+        } else {
+            if (!jselTypeCheck(o,token[0])) return NULL;
+        }
+    }
+    return o;
+}
+
+/* Evaluate the compiled selector against 'o', taking the values of the
+ * "*" placeholders from the arguments. Returns the selected object, or
+ * NULL if not found (or if 'sel' is NULL). */
+cJSON *cJSON_SelectCompiled(cJSON *o, const cJSON_Selector *sel, ...) {
+    va_list ap;
+    va_start(ap,sel);
+    o = cJSON_SelectCompiledV(o,sel,&ap);
+    va_end(ap);
+    return o;
+}
+
+/* Multiple selectors evaluated in a single traversal.
+ *
+ * When many fields of the same object are needed, evaluating a selector
+ * for each of them walks the same objects again and again, scanning the
+ * fields lists from the start every time. cJSON_SelectMany() instead
+ * builds a trie of the requested paths (so ".chat.id" and ".chat.type"
+ * share the ".chat" node), and then visits every object at most once,
+ * scanning its fields a single time, and matching each field against all
+ * the children of the current trie node:
+ *
+ *  const char *paths[] = {".chat.id:n", ".chat.type:s", ".text:s"};
+ *  cJSON *out[3];
+ *  cJSON_SelectMany(msg,paths,out,3);
+ *
+ * After the call out[j] is the object selected by paths[j], or NULL, like
+ * cJSON_Select() would return. When the same paths are evaluated many
+ * times, the trie can be built once with cJSON_SelectManyCompile(), and
+ * evaluated with cJSON_SelectManyCompiled(). The "*" placeholders are not
+ * supported here: paths containing them (or invalid paths) always select
+ * NULL. */
+typedef struct jselNode {
+    int type;                   /* Type of the step leading here. */
+    char *token;                /* Field name or type letter. */
+    int index;                  /* Array index, for JSEL_ARRAY. */
+    struct jselNode **children;
+    int numchildren;
+    int *outputs;               /* Paths terminating at this node. */
+    int numoutputs;
+} jselNode;
+
+struct cJSON_MultiSelector {
+    jselNode *root;
+    int numpaths;
+};
+
+static jselNode *jselNodeCreate(int type, const char *token, int index) {
+    jselNode *n = malloc(sizeof(*n));
+    if (n == NULL) return NULL;
+    n->type = type;
+    n->token = NULL;
+    if (token) {
+        size_t len = strlen(token);
+        if ((n->token = malloc(len+1)) == NULL) {
+            free(n);
+            return NULL;
+        }
+        memcpy(n->token,token,len+1);
+    }
+    n->index = index;
+    n->children = NULL;
+    n->numchildren = 0;
+    n->outputs = NULL;
+    n->numoutputs = 0;
+    return n;
+}
+
+static void jselNodeFree(jselNode *n) {
+    for (int j = 0; j < n->numchildren; j++) jselNodeFree(n->children[j]);
+    free(n->children);
+    free(n->outputs);
+    free(n->token);
+    free(n);
+}
+
+/* Return the child of 'n' reached with the specified step, creating it
+ * if needed. Returns NULL on out of memory. */
+static jselNode *jselNodeChild(jselNode *n, const jselStep *step) {
+    for (int j = 0; j < n->numchildren; j++) {
+        jselNode *c = n->children[j];
+        if (c->type != step->type) continue;
+        if (c->type == JSEL_ARRAY ? c->index == step->index :
+                                    !strcmp(c->token,step->token)) return c;
+    }
+    jselNode **children = realloc(n->children,
+                                  sizeof(jselNode*)*(n->numchildren+1));
+    if (children == NULL) return NULL;
+    n->children = children;
+    jselNode *c = jselNodeCreate(step->type,step->token,step->index);
+    if (c == NULL) return NULL;
+    n->children[n->numchildren++] = c;
+    return c;
+}
+
+/* Build the trie of the 'n' paths. Returns NULL on out of memory. The
+ * returned object should be freed with cJSON_SelectManyFree(). */
+cJSON_MultiSelector *cJSON_SelectManyCompile(const char **paths, int n) {
+    cJSON_MultiSelector *ms = malloc(sizeof(*ms));
+    if (ms == NULL) return NULL;
+    ms->numpaths = n;
+    ms->root = jselNodeCreate(JSEL_INVALID,NULL,0);
+    if (ms->root == NULL) goto oom;
+
+    for (int j = 0; j < n; j++) {
+        cJSON_Selector *sel = cJSON_SelectCompile(paths[j]);
+        if (sel == NULL) continue; /* Invalid: always NULL. */
+        jselNode *node = ms->root;
+        for (int i = 0; i < sel->numsteps && node; i++) {
+            if (sel->steps[i].params) {
+                node = NULL; /* Not supported: always NULL. */
+                break;
+            }
+            node = jselNodeChild(node,sel->steps+i);
+            if (node == NULL) {
+                cJSON_SelectFree(sel);
+                goto oom;
+            }
+        }
+        cJSON_SelectFree(sel);
+        if (node == NULL) continue;
+        int *outputs = realloc(node->outputs,sizeof(int)*(node->numoutputs+1));
+        if (outputs == NULL) goto oom;
+        node->outputs = outputs;
+        node->outputs[node->numoutputs++] = j;
+    }
+    return ms;
+
+oom:
+    cJSON_SelectManyFree(ms);
+    return NULL;
+}
+
+void cJSON_SelectManyFree(cJSON_MultiSelector *ms) {
+    if (ms == NULL) return;
+    if (ms->root) jselNodeFree(ms->root);
+    free(ms);
+}
+
+/* Match the object 'o' against the trie node 'n', filling the outputs. */
+#define JSEL_MAX_STACK_CHILDREN 32
+static void jselWalk(cJSON *o, const jselNode *n, cJSON **out) {
+    for (int j = 0; j < n->numoutputs; j++) out[n->outputs[j]] = o;
+    if (n->numchildren == 0) return;
+
+    /* Type checks select the same object. Fields and indexes are matched
+     * scanning the object or array just once, stopping as soon as all
+     * the children were found. Only the first field with a given name is
+     * considered, like cJSON_GetObjectItemCaseSensitive() does. */
+    char stackbuf[JSEL_MAX_STACK_CHILDREN], *matched = stackbuf;
+    if (n->numchildren > JSEL_MAX_STACK_CHILDREN) {
+        matched = malloc(n->numchildren);
+        if (matched == NULL) return;
+    }
+    int left = 0, isobj = cJSON_IsObject(o), isarray = cJSON_IsArray(o);
+    for (int j = 0; j < n->numchildren; j++) {
+        const jselNode *c = n->children[j];
+        matched[j] = 1;
+        if (c->type == JSEL_TYPECHECK) {
+            if (jselTypeCheck(o,c->token[0])) jselWalk(o,c,out);
+        } else if ((c->type == JSEL_OBJ && isobj) ||
+                   (c->type == JSEL_ARRAY && isarray)) {
+            matched[j] = 0;
+            left++;
+        }
+    }
+
+    int idx = 0;
+    for (cJSON *item = left ? cJSON_GetChild(o) : NULL; item && left;
+         item = item->next, idx++)
+    {
+        for (int j = 0; j < n->numchildren; j++) {
+            if (matched[j]) continue;
+            const jselNode *c = n->children[j];
+            if (isobj ? (item->string && !strcmp(item->string,c->token)) :
+                        idx == c->index)
+            {
+                matched[j] = 1;
+                left--;
+                jselWalk(item,c,out);
+            }
+        }
+    }
+    if (matched != stackbuf) free(matched);
+}
+
+/* Evaluate the compiled paths against 'o', storing in out[j] the object
+ * selected by the j-th path, or NULL. */
+void cJSON_SelectManyCompiled(cJSON *o, const cJSON_MultiSelector *ms, cJSON **out) {
+    for (int j = 0; j < ms->numpaths; j++) out[j] = NULL;
+    if (o) jselWalk(o,ms->root,out);
+}
+
+/* Evaluate the 'n' paths against 'o' in a single traversal, storing in
+ * out[j] the object selected by paths[j], or NULL. Returns 0 on out of
+ * memory (all the outputs are set to NULL), otherwise 1. */
+int cJSON_SelectMany(cJSON *o, const char **paths, cJSON **out, int n) {
+    cJSON_MultiSelector *ms = cJSON_SelectManyCompile(paths,n);
+    if (ms == NULL) {
+        for (int j = 0; j < n; j++) out[j] = NULL;
+        return 0;
+    }
+    cJSON_SelectManyCompiled(o,ms,out);
+    cJSON_SelectManyFree(ms);
+    return 1;
+}
+
+/* ============================================================================
+ * Streaming JSON writer.
+ *
+ * Building a cJSON tree only to print it allocates every node and then a
+ * separate output buffer. The writer instead appends the JSON directly to
+ * an SDS string, as the caller emits the values:
+ *
+ *  jsonWriter w;
+ *  jsonWriterInit(&w,NULL);
+ *  jsonWriterObjectStart(&w);
+ *  jsonWriterKey(&w,"chat_id"); jsonWriterInt(&w,chat_id);
+ *  jsonWriterKey(&w,"text"); jsonWriterString(&w,text);
+ *  jsonWriterObjectEnd(&w);
+ *  sds json = jsonWriterDone(&w);
+ *
+ * Commas and colons are added automatically. No validation is performed:
+ * the caller is responsible for emitting keys only inside objects, and
+ * for balancing starts and ends. Up to JSON_WRITER_MAX_DEPTH nesting
+ * levels are supported.
+ * ==========================================================================*/
+
+/* Escape sequence of each byte: 0 if no escape is needed, 'u' for \u00XX,
+ * otherwise the char to emit after the backslash. */
+static const char JsonEscape[256] = {
+    'u','u','u','u','u','u','u','u','b','t','n','u','f','r','u','u',
+    'u','u','u','u','u','u','u','u','u','u','u','u','u','u','u','u',
+    ['"'] = '"', ['\\'] = '\\'
+};
+
+/* SWAR tests on 8 bytes at a time: true if any byte is zero, or less
+ * than 'n' (for n <= 128). */
+#define JSON_ONES 0x0101010101010101ULL
+#define JSON_HIGHS 0x8080808080808080ULL
+#define JSON_HASZERO(x) (((x) - JSON_ONES) & ~(x) & JSON_HIGHS)
+#define JSON_HASLESS(x,n) (((x) - JSON_ONES*(n)) & ~(x) & JSON_HIGHS)
+
+/* Return the length of the prefix of 'p' that needs no escaping. Strings
+ * are usually mostly plain text, so we test 8 bytes at a time. */
+static size_t jsonPlainPrefix(const unsigned char *p, size_t len) {
+    size_t i = 0;
+    while (i + 8 <= len) {
+        uint64_t x;
+        memcpy(&x,p+i,sizeof(x));
+        if (JSON_HASLESS(x,0x20) ||
+            JSON_HASZERO(x ^ (JSON_ONES*'"')) ||
+            JSON_HASZERO(x ^ (JSON_ONES*'\\'))) break;
+        i += 8;
+    }
+    while (i < len && JsonEscape[p[i]] == 0) i++;
+    return i;
+}
+
+/* Append 'p' as a JSON quoted string. */
+static sds jsonCatString(sds s, const char *str, size_t len) {
+    const unsigned char *p = (const unsigned char*)str;
+    s = sdscatlen(s,"\"",1);
+    while (len) {
+        size_t plain = jsonPlainPrefix(p,len);
+        if (plain) s = sdscatlen(s,p,plain);
+        p += plain;
+        len -= plain;
+        if (len == 0) break;
+
+        /* Byte to escape. */
+        char esc = JsonEscape[*p];
+        if (esc == 'u') {
+            char buf[7];
+            snprintf(buf,sizeof(buf),"\\u%04x",*p);
+            s = sdscatlen(s,buf,6);
+        } else {
+            char buf[2] = {'\\', esc};
+            s = sdscatlen(s,buf,2);
+        }
+        p++;
+        len--;
+    }
+    return sdscatlen(s,"\"",1);
+}
+
+/* Initialize the writer so that it appends to 'buf', or to a new empty
+ * string if 'buf' is NULL. */
+void jsonWriterInit(jsonWriter *w, sds buf) {
+    w->buf = buf ? buf : sdsempty();
+    w->depth = 0;
+    w->nonempty = 0;
+    w->afterkey = 0;
+}
+
+/* Return the JSON produced so far. The caller owns the string, and the
+ * writer should not be used anymore unless initialized again. */
+sds jsonWriterDone(jsonWriter *w) {
+    sds buf = w->buf;
+    w->buf = NULL;
+    return buf;
+}
+
+/* Emit the comma needed before a new value or key, if any. */
+static void jsonWriterSeparator(jsonWriter *w) {
+    if (w->afterkey) {
+        w->afterkey = 0;
+        return;
+    }
+    if (w->depth == 0 || w->depth > JSON_WRITER_MAX_DEPTH) return;
+    uint64_t bit = 1ULL << (w->depth-1);
+    if (w->nonempty & bit) w->buf = sdscatlen(w->buf,",",1);
+    w->nonempty |= bit;
+}
+
+static void jsonWriterOpen(jsonWriter *w, const char *bracket) {
+    jsonWriterSeparator(w);
+    w->buf = sdscatlen(w->buf,bracket,1);
+    w->depth++;
+    if (w->depth <= JSON_WRITER_MAX_DEPTH)
+        w->nonempty &= ~(1ULL << (w->depth-1));
+}
+
+static void jsonWriterClose(jsonWriter *w, const char *bracket) {
+    if (w->depth > 0) w->depth--;
+    w->buf = sdscatlen(w->buf,bracket,1);
+}
+
+void jsonWriterObjectStart(jsonWriter *w) { jsonWriterOpen(w,"{"); }
+void jsonWriterObjectEnd(jsonWriter *w) { jsonWriterClose(w,"}"); }
+void jsonWriterArrayStart(jsonWriter *w) { jsonWriterOpen(w,"["); }
+void jsonWriterArrayEnd(jsonWriter *w) { jsonWriterClose(w,"]"); }
+
+/* Emit the key of the next object field. */
+void jsonWriterKey(jsonWriter *w, const char *key) {
+    jsonWriterSeparator(w);
+    w->buf = jsonCatString(w->buf,key,strlen(key));
+    w->buf = sdscatlen(w->buf,":",1);
+    w->afterkey = 1;
+}
+
+void jsonWriterStringLen(jsonWriter *w, const char *s, size_t len) {
+    jsonWriterSeparator(w);
+    w->buf = jsonCatString(w->buf,s,len);
+}
+
+/* Emit a string, or null if 's' is NULL. */
+void jsonWriterString(jsonWriter *w, const char *s) {
+    if (s == NULL) {
+        jsonWriterNull(w);
+        return;
+    }
+    jsonWriterStringLen(w,s,strlen(s));
+}
+
+void jsonWriterInt(jsonWriter *w, int64_t value) {
+    jsonWriterSeparator(w);
+    w->buf = sdscatfmt(w->buf,"%I",value);
+}
+
+/* Emit a double with the fewest digits (up to 17) that parse back to the
+ * same value. NaN and infinity, that JSON can't represent, become null.
+ * Like cJSON does, the decimal point of the current locale, that both
+ * snprintf() and strtod() use, is replaced with '.' in the output. */
+void jsonWriterDouble(jsonWriter *w, double value) {
+    if (isnan(value) || isinf(value)) {
+        jsonWriterNull(w);
+        return;
+    }
+    if (value > -9007199254740992.0 && value < 9007199254740992.0 &&
+        value == (double)(int64_t)value && !(value == 0 && signbit(value)))
+    {
+        jsonWriterInt(w,(int64_t)value);
+        return;
+    }
+    char buf[32];
+    int len = 0;
+    for (int precision = 15; precision <= 17; precision++) {
+        len = snprintf(buf,sizeof(buf),"%.*g",precision,value);
+        if (strtod(buf,NULL) == value) break;
+    }
+    char point = localeconv()->decimal_point[0];
+    if (point != '.') {
+        char *p = strchr(buf,point);
+        if (p) *p = '.';
+    }
+    jsonWriterSeparator(w);
+    w->buf = sdscatlen(w->buf,buf,len);
+}
+
+void jsonWriterBool(jsonWriter *w, int value) {
+    jsonWriterSeparator(w);
+    w->buf = value ? sdscatlen(w->buf,"true",4) : sdscatlen(w->buf,"false",5);
+}
+
+void jsonWriterNull(jsonWriter *w) {
+    jsonWriterSeparator(w);
+    w->buf = sdscatlen(w->buf,"null",4);
+}
+
+/* Emit a value already rendered as JSON, as it is. */
+void jsonWriterRaw(jsonWriter *w, const char *json) {
+    jsonWriterSeparator(w);
+    w->buf = sdscat(w->buf,json);
+}
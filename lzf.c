@@ -0,0 +1,141 @@
+/* ============================================================================
+ * LZF compression.
+ *
+ * A small and fast LZ77 codec producing the LZF format (the one used by
+ * Redis for RDB files), so that the output can be inspected with existing
+ * tools. The compressed stream is a sequence of chunks, each starting with
+ * a control byte:
+ *
+ *  000LLLLL <L+1 bytes>            Literal run of 1 to 32 bytes.
+ *  LLLooooo oooooooo               Back reference of L+2 bytes (L < 7),
+ *                                  starting offset+1 bytes before the
+ *                                  current output position.
+ *  111ooooo LLLLLLLL oooooooo      Back reference of L+9 bytes.
+ *
+ * So matches are from 3 to 264 bytes long, at most 8192 bytes back. The
+ * compressor finds matches hashing the next three input bytes into a
+ * table of the last positions where each hash was seen: it is not very
+ * smart, but it is fast, and data like JSON API replies, with many
+ * repeated field names, compresses well anyway.
+ * ==========================================================================*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lzf.h"
+
+#define LZF_HASH_BITS 14
+#define LZF_MAX_LIT 32                  /* Longest literal run. */
+#define LZF_MAX_OFF (1<<13)             /* Farthest back reference. */
+#define LZF_MAX_REF ((1<<8)+(1<<3))     /* Longest back reference. */
+
+static inline uint32_t lzfHash(const uint8_t *p) {
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (v * 2654435761U) >> (32-LZF_HASH_BITS);
+}
+
+size_t lzfCompress(const void *in, size_t in_len, void *out, size_t out_len) {
+    const uint8_t *base = in, *ip = base, *in_end = base+in_len;
+    uint8_t *op = out, *out_end = op+out_len;
+    /* Positions are stored plus one, so that zero means empty slot. */
+    uint32_t htab[1<<LZF_HASH_BITS];
+    uint8_t *litctrl;   /* Control byte of the current literal run. */
+    int lit = 0;        /* Length of the current literal run. */
+
+    if (in_len == 0 || out_len == 0) return 0;
+    memset(htab,0,sizeof(htab));
+    litctrl = op++;
+
+    while(ip < in_end) {
+        size_t len = 0, off = 0;
+
+        /* Look for a match of at least three bytes. */
+        if (ip+2 < in_end) {
+            uint32_t h = lzfHash(ip);
+            const uint8_t *ref = htab[h] ? base+htab[h]-1 : NULL;
+            if (ref && (off = ip-ref-1) < LZF_MAX_OFF &&
+                ref[0] == ip[0] && ref[1] == ip[1] && ref[2] == ip[2])
+            {
+                size_t maxlen = in_end-ip;
+                if (maxlen > LZF_MAX_REF) maxlen = LZF_MAX_REF;
+                len = 3;
+                while(len < maxlen && ref[len] == ip[len]) len++;
+            }
+            htab[h] = ip-base+1;
+        }
+
+        if (len == 0) {
+            /* Emit a literal byte, closing the run if it is full. */
+            if (op >= out_end) return 0;
+            *op++ = *ip++;
+            if (++lit == LZF_MAX_LIT) {
+                *litctrl = lit-1;
+                if (op >= out_end) return 0;
+                litctrl = op++;
+                lit = 0;
+            }
+            continue;
+        }
+
+        /* Close the literal run (or drop its unused control byte), then
+         * emit the back reference and open a new literal run. */
+        if (lit) *litctrl = lit-1;
+        else op--;
+        if (op+4 > out_end) return 0;
+        len -= 2;
+        if (len < 7) {
+            *op++ = (off >> 8) + (len << 5);
+        } else {
+            *op++ = (off >> 8) + (7 << 5);
+            *op++ = len-7;
+        }
+        *op++ = off & 0xff;
+        litctrl = op++;
+        lit = 0;
+        len += 2;
+
+        /* Remember the positions inside the match as well, so that
+         * following data can reference them. */
+        for (size_t j = 1; j < len && ip+j+2 < in_end; j++)
+            htab[lzfHash(ip+j)] = ip+j-base+1;
+        ip += len;
+    }
+
+    if (lit) *litctrl = lit-1;
+    else op--;
+    return op-(uint8_t*)out;
+}
+
+size_t lzfDecompress(const void *in, size_t in_len, void *out, size_t out_len) {
+    const uint8_t *ip = in, *in_end = ip+in_len;
+    uint8_t *op = out, *out_end = op+out_len;
+
+    while(ip < in_end) {
+        size_t ctrl = *ip++;
+        if (ctrl < 32) {
+            /* Literal run. */
+            ctrl++;
+            if ((size_t)(out_end-op) < ctrl || (size_t)(in_end-ip) < ctrl)
+                return 0;
+            memcpy(op,ip,ctrl);
+            op += ctrl;
+            ip += ctrl;
+        } else {
+            /* Back reference. */
+            size_t len = ctrl >> 5;
+            if (len == 7) {
+                if (ip >= in_end) return 0;
+                len += *ip++;
+            }
+            if (ip >= in_end) return 0;
+            size_t off = ((ctrl & 0x1f) << 8) + *ip++ + 1;
+            len += 2;
+            if ((size_t)(out_end-op) < len ||
+                (size_t)(op-(uint8_t*)out) < off) return 0;
+            /* The source and destination may overlap: copy bytewise. */
+            const uint8_t *ref = op-off;
+            while(len--) *op++ = *ref++;
+        }
+    }
+    return op-(uint8_t*)out;
+}
@@ -0,0 +1,12 @@
+#ifndef LZF_H
+#define LZF_H
+
+#include <stddef.h>
+
+/* Compress / decompress using the LZF format. Both functions return the
+ * number of bytes written to 'out', or 0 if the output does not fit in
+ * 'out_len' bytes (or, for lzfDecompress(), if the input is corrupted). */
+size_t lzfCompress(const void *in, size_t in_len, void *out, size_t out_len);
+size_t lzfDecompress(const void *in, size_t in_len, void *out, size_t out_len);
+
+#endif
@@ -0,0 +1,372 @@
+/* ============================================================================
+ * In memory key value table.
+ *
+ * A hash table mapping string keys to string values with an optional
+ * expire time, safe to use from multiple threads. The keys are spread
+ * across MEMKV_STRIPES stripes, each with its own lock, so that threads
+ * accessing different keys rarely wait for each other. When a memory limit
+ * is set, the least recently used keys of a stripe are evicted once the
+ * stripe uses more than its share of memory.
+ *
+ * This is used as a write-through cache in front of the SQLite KV store.
+ * ==========================================================================*/
+
+#define _POSIX_C_SOURCE 200809L /* fileno() and fsync(). */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memkv.h"
+#include "xmalloc.h"
+
+#define MEMKV_INITIAL_BUCKETS 16
+
+/* Memory accounted for every entry, in addition to key and value. */
+#define MEMKV_ENTRY_OVERHEAD (sizeof(memkvEntry)+32)
+
+/* FNV-1a hash function. */
+static uint64_t memkvHash(const char *key) {
+    uint64_t h = 14695981039346656037ULL;
+    while(*key) {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* The stripe is selected using the high bits of the hash, while the
+ * bucket inside the stripe uses the low bits. */
+static memkvStripe *memkvGetStripe(memkv *t, uint64_t hash) {
+    return t->stripe + (hash >> 60) % MEMKV_STRIPES;
+}
+
+static size_t memkvEntrySize(memkvEntry *e) {
+    return MEMKV_ENTRY_OVERHEAD+sdslen(e->key)+sdslen(e->value);
+}
+
+/* Create a new table. If 'maxmem' is non zero, it is the amount of memory,
+ * in bytes, after which the least recently used keys are evicted. */
+memkv *memkvCreate(size_t maxmem) {
+    memkv *t = xmalloc(sizeof(*t));
+    t->maxmem = maxmem;
+    for (int j = 0; j < MEMKV_STRIPES; j++) {
+        memkvStripe *s = t->stripe+j;
+        pthread_mutex_init(&s->lock,NULL);
+        s->numbuckets = MEMKV_INITIAL_BUCKETS;
+        s->buckets = xmalloc(sizeof(memkvEntry*)*s->numbuckets);
+        memset(s->buckets,0,sizeof(memkvEntry*)*s->numbuckets);
+        s->numkeys = 0;
+        s->used = 0;
+        s->lru_head = s->lru_tail = NULL;
+        s->gen = 0;
+        s->hits = s->misses = s->evictions = 0;
+        s->expire_cursor = 0;
+    }
+    return t;
+}
+
+/* LRU list handling. */
+static void memkvLruUnlink(memkvStripe *s, memkvEntry *e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else s->lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else s->lru_tail = e->lru_prev;
+}
+
+static void memkvLruPush(memkvStripe *s, memkvEntry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = s->lru_head;
+    if (s->lru_head) s->lru_head->lru_prev = e;
+    s->lru_head = e;
+    if (s->lru_tail == NULL) s->lru_tail = e;
+}
+
+/* Find the entry for 'key'. If 'prevptr' is not NULL, the pointer
+ * referencing the entry in the bucket chain is returned by reference,
+ * so that the caller can unlink it. */
+static memkvEntry *memkvFind(memkvStripe *s, const char *key, uint64_t hash, memkvEntry ***prevptr) {
+    memkvEntry **ref = s->buckets + (hash & (s->numbuckets-1));
+    while(*ref) {
+        memkvEntry *e = *ref;
+        if (e->hash == hash && !strcmp(e->key,key)) {
+            if (prevptr) *prevptr = ref;
+            return e;
+        }
+        ref = &e->next;
+    }
+    return NULL;
+}
+
+/* Remove the entry from the stripe and free it. */
+static void memkvRemove(memkvStripe *s, memkvEntry *e, memkvEntry **ref) {
+    *ref = e->next;
+    memkvLruUnlink(s,e);
+    s->used -= memkvEntrySize(e);
+    s->numkeys--;
+    sdsfree(e->key);
+    sdsfree(e->value);
+    xfree(e);
+}
+
+/* Double the number of buckets of the stripe. Keys are few per stripe
+ * compared to what a bot usually caches, so a blocking rehash is fine. */
+static void memkvExpand(memkvStripe *s) {
+    uint64_t newsize = s->numbuckets*2;
+    memkvEntry **nb = xmalloc(sizeof(memkvEntry*)*newsize);
+    memset(nb,0,sizeof(memkvEntry*)*newsize);
+    for (uint64_t j = 0; j < s->numbuckets; j++) {
+        memkvEntry *e = s->buckets[j];
+        while(e) {
+            memkvEntry *next = e->next;
+            uint64_t idx = e->hash & (newsize-1);
+            e->next = nb[idx];
+            nb[idx] = e;
+            e = next;
+        }
+    }
+    xfree(s->buckets);
+    s->buckets = nb;
+    s->numbuckets = newsize;
+}
+
+/* Evict the least recently used keys while the stripe is over its
+ * share of the memory limit. */
+static void memkvEvict(memkv *t, memkvStripe *s) {
+    if (t->maxmem == 0) return;
+    size_t limit = t->maxmem/MEMKV_STRIPES;
+    while(s->used > limit && s->lru_tail) {
+        memkvEntry *e = s->lru_tail, **ref = NULL;
+        memkvFind(s,e->key,e->hash,&ref);
+        memkvRemove(s,e,ref);
+        s->evictions++;
+    }
+}
+
+/* Return a copy of the value stored at 'key' as an SDS string, or NULL
+ * if the key does not exist or is expired. If 'gen' is not NULL, the
+ * current generation of the stripe is returned by reference, to be
+ * later passed to memkvFill(). */
+sds memkvGet(memkv *t, const char *key, uint64_t *gen) {
+    uint64_t hash = memkvHash(key);
+    memkvStripe *s = memkvGetStripe(t,hash);
+    memkvEntry *e, **ref;
+    sds value = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    e = memkvFind(s,key,hash,&ref);
+    if (e && e->expire && e->expire < time(NULL)) {
+        memkvRemove(s,e,ref);
+        s->gen++;
+        e = NULL;
+    }
+    if (e) {
+        value = sdsnewlen(e->value,sdslen(e->value));
+        memkvLruUnlink(s,e);
+        memkvLruPush(s,e);
+        s->hits++;
+    } else {
+        s->misses++;
+    }
+    if (gen) *gen = s->gen;
+    pthread_mutex_unlock(&s->lock);
+    return value;
+}
+
+/* Set the key to the specified value, with the specified absolute unix
+ * time expire (0 means no expire). Must be called with the stripe locked. */
+static void memkvSetLocked(memkv *t, memkvStripe *s, const char *key, uint64_t hash, const char *value, size_t vlen, int64_t expire) {
+    memkvEntry *e = memkvFind(s,key,hash,NULL);
+    if (e) {
+        s->used -= memkvEntrySize(e);
+        e->value = sdscpylen(e->value,value,vlen);
+        memkvLruUnlink(s,e);
+    } else {
+        if (s->numkeys >= s->numbuckets) memkvExpand(s);
+        e = xmalloc(sizeof(*e));
+        e->key = sdsnew(key);
+        e->value = sdsnewlen(value,vlen);
+        e->hash = hash;
+        uint64_t idx = hash & (s->numbuckets-1);
+        e->next = s->buckets[idx];
+        s->buckets[idx] = e;
+        s->numkeys++;
+    }
+    e->expire = expire;
+    s->used += memkvEntrySize(e);
+    memkvLruPush(s,e);
+    s->gen++;
+    memkvEvict(t,s);
+}
+
+/* Set the key to the specified value. 'expire' is the absolute unix time
+ * at which the key expires, or 0. */
+void memkvSet(memkv *t, const char *key, const char *value, size_t vlen, int64_t expire) {
+    uint64_t hash = memkvHash(key);
+    memkvStripe *s = memkvGetStripe(t,hash);
+    pthread_mutex_lock(&s->lock);
+    memkvSetLocked(t,s,key,hash,value,vlen,expire);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Like memkvSet(), but the key is set only if the stripe was not modified
+ * since memkvGet() returned the generation 'gen'. This is used to populate
+ * the cache after a miss, without the risk of overwriting a newer value
+ * set (or a deletion performed) by another thread in the meantime. */
+void memkvFill(memkv *t, const char *key, const char *value, size_t vlen, int64_t expire, uint64_t gen) {
+    uint64_t hash = memkvHash(key);
+    memkvStripe *s = memkvGetStripe(t,hash);
+    pthread_mutex_lock(&s->lock);
+    if (s->gen == gen) memkvSetLocked(t,s,key,hash,value,vlen,expire);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Delete the key. Return 1 if the key existed, 0 otherwise. */
+int memkvDel(memkv *t, const char *key) {
+    uint64_t hash = memkvHash(key);
+    memkvStripe *s = memkvGetStripe(t,hash);
+    memkvEntry *e, **ref;
+    pthread_mutex_lock(&s->lock);
+    e = memkvFind(s,key,hash,&ref);
+    if (e) memkvRemove(s,e,ref);
+    s->gen++;
+    pthread_mutex_unlock(&s->lock);
+    return e != NULL;
+}
+
+/* Append the table statistics to the 'info' SDS string, and return it. */
+sds memkvInfo(memkv *t, sds info) {
+    uint64_t keys = 0, hits = 0, misses = 0, evictions = 0;
+    size_t used = 0;
+    for (int j = 0; j < MEMKV_STRIPES; j++) {
+        memkvStripe *s = t->stripe+j;
+        pthread_mutex_lock(&s->lock);
+        keys += s->numkeys;
+        used += s->used;
+        hits += s->hits;
+        misses += s->misses;
+        evictions += s->evictions;
+        pthread_mutex_unlock(&s->lock);
+    }
+    return sdscatprintf(info,
+        "keys:%llu\n"
+        "used_memory:%zu\n"
+        "max_memory:%zu\n"
+        "hits:%llu\n"
+        "misses:%llu\n"
+        "hit_ratio:%.4f\n"
+        "evictions:%llu\n",
+        (unsigned long long)keys, used, t->maxmem,
+        (unsigned long long)hits, (unsigned long long)misses,
+        hits+misses ? (double)hits/(hits+misses) : 0,
+        (unsigned long long)evictions);
+}
+
+/* Incrementally delete the expired keys, checking up to 'buckets' buckets
+ * of every stripe, starting from where the previous call stopped. Keys
+ * are otherwise only deleted when accessed, so this should be called
+ * periodically when the table is not used as a cache with a memory
+ * limit. Returns the number of keys deleted. */
+int memkvExpire(memkv *t, int buckets) {
+    int64_t now = time(NULL);
+    int deleted = 0;
+    for (int j = 0; j < MEMKV_STRIPES; j++) {
+        memkvStripe *s = t->stripe+j;
+        pthread_mutex_lock(&s->lock);
+        for (int i = 0; i < buckets && (uint64_t)i < s->numbuckets; i++) {
+            uint64_t idx = s->expire_cursor++ & (s->numbuckets-1);
+            memkvEntry **ref = s->buckets+idx;
+            while(*ref) {
+                memkvEntry *e = *ref;
+                if (e->expire && e->expire < now) {
+                    memkvRemove(s,e,ref);
+                    s->gen++;
+                    deleted++;
+                } else {
+                    ref = &e->next;
+                }
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    return deleted;
+}
+
+/* Snapshot file format: the MEMKV_SNAPSHOT_MAGIC string, then for every
+ * key its expire (int64_t), key length and value length (uint32_t), key
+ * and value, using the native byte order: snapshots are meant to be
+ * loaded again by the same process after a restart, not moved across
+ * machines. */
+#define MEMKV_SNAPSHOT_MAGIC "MEMKV001"
+
+/* Save the non expired keys to the specified file. The file is written
+ * to a temporary file and then renamed, so an existing snapshot is never
+ * left half written. Return 1 on success, 0 on error. */
+int memkvSave(memkv *t, const char *filename) {
+    int64_t now = time(NULL);
+    sds tmp = sdscatprintf(sdsempty(),"%s.tmp",filename);
+    FILE *fp = fopen(tmp,"w");
+    int ok = fp != NULL;
+
+    if (ok) ok = fwrite(MEMKV_SNAPSHOT_MAGIC,8,1,fp) == 1;
+    for (int j = 0; j < MEMKV_STRIPES && ok; j++) {
+        memkvStripe *s = t->stripe+j;
+        pthread_mutex_lock(&s->lock);
+        /* From the oldest key, so that loading restores the LRU order. */
+        for (memkvEntry *e = s->lru_tail; e && ok; e = e->lru_prev) {
+            if (e->expire && e->expire < now) continue;
+            uint32_t klen = sdslen(e->key), vlen = sdslen(e->value);
+            ok = fwrite(&e->expire,sizeof(e->expire),1,fp) == 1 &&
+                 fwrite(&klen,sizeof(klen),1,fp) == 1 &&
+                 fwrite(&vlen,sizeof(vlen),1,fp) == 1 &&
+                 fwrite(e->key,1,klen,fp) == klen &&
+                 fwrite(e->value,1,vlen,fp) == vlen;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    if (fp) {
+        if (fflush(fp) || fsync(fileno(fp))) ok = 0;
+        fclose(fp);
+    }
+    if (ok) ok = rename(tmp,filename) == 0;
+    if (!ok) unlink(tmp);
+    sdsfree(tmp);
+    return ok;
+}
+
+/* Load the keys of a snapshot produced by memkvSave() into the table.
+ * Keys expired in the meantime are skipped. Return 1 on success, 0 if the
+ * file can't be opened or is corrupted (in this case the keys loaded
+ * before the error are retained). */
+int memkvLoad(memkv *t, const char *filename) {
+    int64_t now = time(NULL);
+    char magic[8];
+    FILE *fp = fopen(filename,"r");
+    if (fp == NULL) return 0;
+
+    int ok = fread(magic,8,1,fp) == 1 &&
+             !memcmp(magic,MEMKV_SNAPSHOT_MAGIC,8);
+    sds key = sdsempty(), value = sdsempty();
+    while(ok) {
+        int64_t expire;
+        uint32_t klen, vlen;
+        if (fread(&expire,sizeof(expire),1,fp) != 1) break; /* EOF. */
+        ok = fread(&klen,sizeof(klen),1,fp) == 1 &&
+             fread(&vlen,sizeof(vlen),1,fp) == 1;
+        if (!ok) break;
+        sdsclear(key);
+        sdsclear(value);
+        key = sdsgrowzero(key,klen);
+        value = sdsgrowzero(value,vlen);
+        ok = fread(key,1,klen,fp) == klen &&
+             fread(value,1,vlen,fp) == vlen;
+        if (ok && (expire == 0 || expire >= now))
+            memkvSet(t,key,value,vlen,expire);
+    }
+    sdsfree(key);
+    sdsfree(value);
+    fclose(fp);
+    return ok;
+}
@@ -0,0 +1,49 @@
+#ifndef MEMKV_H
+#define MEMKV_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "sds.h"
+
+#define MEMKV_STRIPES 16    /* Number of independently locked stripes. */
+
+typedef struct memkvEntry {
+    sds key;
+    sds value;
+    int64_t expire;             /* Unix time, 0 = never expires. */
+    uint64_t hash;
+    struct memkvEntry *next;    /* Next entry in the same bucket. */
+    struct memkvEntry *lru_prev, *lru_next; /* LRU list, head = newest. */
+} memkvEntry;
+
+/* Every stripe is a complete hash table with its lock, LRU list and
+ * memory limit, so that threads accessing different keys rarely
+ * contend the same lock. */
+typedef struct memkvStripe {
+    pthread_mutex_t lock;
+    memkvEntry **buckets;
+    uint64_t numbuckets;        /* Always a power of two. */
+    uint64_t numkeys;
+    size_t used;                /* Memory used by the entries. */
+    memkvEntry *lru_head, *lru_tail;
+    uint64_t gen;               /* Incremented at every modification. */
+    uint64_t hits, misses, evictions;
+    uint64_t expire_cursor;     /* Next bucket to check, memkvExpire(). */
+} memkvStripe;
+
+typedef struct memkv {
+    size_t maxmem;              /* Memory limit, 0 = no limit. */
+    memkvStripe stripe[MEMKV_STRIPES];
+} memkv;
+
+memkv *memkvCreate(size_t maxmem);
+sds memkvGet(memkv *t, const char *key, uint64_t *gen);
+void memkvSet(memkv *t, const char *key, const char *value, size_t vlen, int64_t expire);
+void memkvFill(memkv *t, const char *key, const char *value, size_t vlen, int64_t expire, uint64_t gen);
+int memkvDel(memkv *t, const char *key);
+sds memkvInfo(memkv *t, sds info);
+int memkvExpire(memkv *t, int buckets);
+int memkvSave(memkv *t, const char *filename);
+int memkvLoad(memkv *t, const char *filename);
+
+#endif
@@ -2,28 +2,612 @@
  * SQLite abstraction
  * ==========================================================================*/
 
+/* Adding these for portablity */
+#define _BSD_SOURCE
+#if defined(__linux__)
+#define _GNU_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <pthread.h>
 #include <sqlite3.h>
 #include <time.h>
-#include "sqlite_wrap.h"
+#include <unistd.h>
 #include "sds.h"
+#include "sqlite_wrap.h"
+#include "memkv.h"
+#include "lzf.h"
+#include "bloom.h"
 #include "botlib.h"
 
 #define SHOW_QUERY_ERRORS 1
 
-/* This is the low level function that we use to model all the higher level
- * functions.
+/* ============================================================================
+ * Query profiler.
  *
- * Queries can contain ?s ?b ?i and ?d special specifiers that are bound to
- * the SQL query, and must be present later as additional arguments after
- * the 'sql' argument.
+ * When enabled with sqlProfileEnable(), every connection set up with
+ * sqlProfileAttach() reports the execution time of its statements via
+ * sqlite3_trace_v2(). Statistics are aggregated per SQL string (that is,
+ * per query format, since arguments are always bound): number of calls,
+ * latency percentiles from a log-linear histogram, and the steps counters
+ * reported by sqlite3_stmt_status(). Statements slower than the slow log
+ * threshold are also logged on standard output.
+ * ==========================================================================*/
+
+#define SQL_PROF_BUCKETS 160    /* 4 buckets for every power of two. */
+#define SQL_PROF_TABLE_SIZE 1024 /* Max number of distinct queries. */
+
+typedef struct sqlProfEntry {
+    sds sql;                    /* Query, as reported by sqlite3_sql(). */
+    uint64_t calls;             /* Number of executions. */
+    uint64_t total_us;          /* Total time, in microseconds. */
+    uint64_t max_us;            /* Slowest execution. */
+    uint64_t fullscan_steps;    /* SQLITE_STMTSTATUS_FULLSCAN_STEP. */
+    uint64_t sort;              /* SQLITE_STMTSTATUS_SORT. */
+    uint64_t autoindex;         /* SQLITE_STMTSTATUS_AUTOINDEX. */
+    uint64_t vm_steps;          /* SQLITE_STMTSTATUS_VM_STEP. */
+    uint32_t hist[SQL_PROF_BUCKETS]; /* Latency histogram. */
+} sqlProfEntry;
+
+static struct {
+    int enabled;                /* True if the profiler is enabled. */
+    int64_t slowlog_us;         /* Slow log threshold, 0 = disabled. */
+    pthread_mutex_t lock;       /* Protects the table. */
+    sqlProfEntry *table[SQL_PROF_TABLE_SIZE]; /* Open addressing table. */
+    int count;                  /* Number of entries in the table. */
+} SqlProf = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* Map a duration in microseconds to the histogram bucket. Values below 4
+ * have their own bucket, then every power of two is split in 4 buckets,
+ * so the error of the reported percentiles is at most 25%. */
+static int sqlProfBucket(uint64_t us) {
+    if (us < 4) return us;
+    int e = 63-__builtin_clzll(us);  /* e >= 2. */
+    int idx = (e-1)*4 + ((us >> (e-2)) & 3);
+    return idx < SQL_PROF_BUCKETS ? idx : SQL_PROF_BUCKETS-1;
+}
+
+/* Return the lower bound, in microseconds, of the specified bucket. */
+static uint64_t sqlProfBucketValue(int idx) {
+    if (idx < 4) return idx;
+    int e = idx/4+1;
+    return (1ULL << e) + ((uint64_t)(idx%4) << (e-2));
+}
+
+/* Return the latency at the specified percentile for the entry. */
+static uint64_t sqlProfPercentile(sqlProfEntry *pe, double perc) {
+    uint64_t rank = (uint64_t)(pe->calls*perc/100), seen = 0;
+    for (int j = 0; j < SQL_PROF_BUCKETS; j++) {
+        seen += pe->hist[j];
+        if (seen > rank) return sqlProfBucketValue(j);
+    }
+    return pe->max_us;
+}
+
+/* Lookup the entry for 'sql', creating it if needed. Returns NULL if the
+ * table is full. Must be called with the lock held. */
+static sqlProfEntry *sqlProfLookup(const char *sql) {
+    uint32_t h = 5381;
+    for (const char *p = sql; *p; p++) h = h*33 + (unsigned char)*p;
+    for (int j = 0; j < SQL_PROF_TABLE_SIZE; j++) {
+        int idx = (h+j) % SQL_PROF_TABLE_SIZE;
+        sqlProfEntry *pe = SqlProf.table[idx];
+        if (pe == NULL) {
+            /* Keep the table at most 75% full. */
+            if (SqlProf.count >= SQL_PROF_TABLE_SIZE/4*3) return NULL;
+            pe = xmalloc(sizeof(*pe));
+            memset(pe,0,sizeof(*pe));
+            pe->sql = sdsnew(sql);
+            SqlProf.table[idx] = pe;
+            SqlProf.count++;
+            return pe;
+        }
+        if (!strcmp(pe->sql,sql)) return pe;
+    }
+    return NULL;
+}
+
+/* The time reported by SQLITE_TRACE_PROFILE has, in most builds, a
+ * resolution of one millisecond, that is too coarse for most of our
+ * queries. So we take our own start time when SQLITE_TRACE_STMT reports
+ * that the statement started running, and use it when the statement
+ * completes. The same thread starts and completes a statement, and only
+ * a few statements can be active at the same time in a given thread, so
+ * a small thread local array is enough. */
+#define SQL_PROF_ACTIVE 16
+static _Thread_local struct {
+    sqlite3_stmt *stmt;
+    uint64_t start;
+} SqlProfActive[SQL_PROF_ACTIVE];
+
+static uint64_t sqlProfUstime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* sqlite3_trace_v2() callback, called when a statement starts running
+ * and when it completes. */
+static int sqlProfTrace(unsigned type, void *privdata, void *p, void *x) {
+    UNUSED(privdata);
+    sqlite3_stmt *stmt = p;
+    int free_slot = -1;
+
+    if (type == SQLITE_TRACE_STMT) {
+        /* SQLite may call us again for the same statement, for instance
+         * when triggers run: only the first call marks the start. */
+        for (int j = 0; j < SQL_PROF_ACTIVE; j++) {
+            if (SqlProfActive[j].stmt == stmt) return 0;
+            if (SqlProfActive[j].stmt == NULL) free_slot = j;
+        }
+        if (free_slot != -1) {
+            SqlProfActive[free_slot].stmt = stmt;
+            SqlProfActive[free_slot].start = sqlProfUstime();
+        }
+        return 0;
+    }
+    if (type != SQLITE_TRACE_PROFILE) return 0;
+
+    /* Use our start time if available, otherwise what SQLite reports. */
+    uint64_t us = (*(sqlite3_int64*)x)/1000;
+    for (int j = 0; j < SQL_PROF_ACTIVE; j++) {
+        if (SqlProfActive[j].stmt == stmt) {
+            us = sqlProfUstime()-SqlProfActive[j].start;
+            SqlProfActive[j].stmt = NULL;
+            break;
+        }
+    }
+
+    const char *sql = sqlite3_sql(stmt);
+    if (sql == NULL) return 0;
+
+    int fullscan = sqlite3_stmt_status(stmt,SQLITE_STMTSTATUS_FULLSCAN_STEP,0);
+    int sort = sqlite3_stmt_status(stmt,SQLITE_STMTSTATUS_SORT,0);
+    int autoindex = sqlite3_stmt_status(stmt,SQLITE_STMTSTATUS_AUTOINDEX,0);
+    int vmsteps = sqlite3_stmt_status(stmt,SQLITE_STMTSTATUS_VM_STEP,0);
+
+    pthread_mutex_lock(&SqlProf.lock);
+    sqlProfEntry *pe = sqlProfLookup(sql);
+    if (pe) {
+        pe->calls++;
+        pe->total_us += us;
+        if (us > pe->max_us) pe->max_us = us;
+        pe->fullscan_steps += fullscan;
+        pe->sort += sort;
+        pe->autoindex += autoindex;
+        pe->vm_steps += vmsteps;
+        pe->hist[sqlProfBucket(us)]++;
+    }
+    pthread_mutex_unlock(&SqlProf.lock);
+
+    if (SqlProf.slowlog_us && (int64_t)us >= SqlProf.slowlog_us) {
+        printf("Slow query (%.3f ms, fullscan steps: %d, sort: %d, "
+               "autoindex: %d): %s\n",
+               (double)us/1000, fullscan, sort, autoindex, sql);
+    }
+    return 0;
+}
+
+/* Enable the profiler. Statements slower than 'slowlog_ms' milliseconds
+ * are logged, if the threshold is greater than zero. Should be called
+ * before any connection is opened, since only connections created
+ * afterward are profiled. */
+void sqlProfileEnable(int64_t slowlog_ms) {
+    SqlProf.enabled = 1;
+    SqlProf.slowlog_us = slowlog_ms*1000;
+}
+
+/* Register the profiler callback on the connection, if the profiler is
+ * enabled. */
+void sqlProfileAttach(sqlite3 *db) {
+    if (!SqlProf.enabled) return;
+    sqlite3_trace_v2(db,SQLITE_TRACE_STMT|SQLITE_TRACE_PROFILE,
+                     sqlProfTrace,NULL);
+}
+
+/* Return a report of the queries statistics, ordered by total time, as
+ * an SDS string that the caller should free. */
+sds sqlProfileReport(void) {
+    sqlProfEntry *entries[SQL_PROF_TABLE_SIZE];
+    int count = 0;
+    sds report = sdsempty();
+
+    pthread_mutex_lock(&SqlProf.lock);
+    for (int j = 0; j < SQL_PROF_TABLE_SIZE; j++)
+        if (SqlProf.table[j]) entries[count++] = SqlProf.table[j];
+
+    /* Sort by total time: a simple insertion sort is fine here. */
+    for (int j = 1; j < count; j++) {
+        sqlProfEntry *pe = entries[j];
+        int i = j-1;
+        while (i >= 0 && entries[i]->total_us < pe->total_us) {
+            entries[i+1] = entries[i];
+            i--;
+        }
+        entries[i+1] = pe;
+    }
+
+    report = sdscatprintf(report,
+        "%-10s %-10s %-10s %-10s %-10s %-12s %-6s %-6s %s\n",
+        "calls","total_ms","p50_us","p99_us","max_us","fullscan/c",
+        "sort","autoix","query");
+    for (int j = 0; j < count; j++) {
+        sqlProfEntry *pe = entries[j];
+        report = sdscatprintf(report,
+            "%-10llu %-10.1f %-10llu %-10llu %-10llu %-12.1f %-6llu %-6llu %s\n",
+            (unsigned long long)pe->calls,
+            (double)pe->total_us/1000,
+            (unsigned long long)sqlProfPercentile(pe,50),
+            (unsigned long long)sqlProfPercentile(pe,99),
+            (unsigned long long)pe->max_us,
+            (double)pe->fullscan_steps/pe->calls,
+            (unsigned long long)pe->sort,
+            (unsigned long long)pe->autoindex,
+            pe->sql);
+    }
+    pthread_mutex_unlock(&SqlProf.lock);
+    return report;
+}
+
+/* Write the queries statistics report into the specified file.
+ * Return 1 on success, 0 on error. */
+int sqlProfileDump(const char *filename) {
+    FILE *fp = fopen(filename,"w");
+    if (fp == NULL) return 0;
+    sds report = sqlProfileReport();
+    int retval = sdslen(report) == 0 ||
+                 fwrite(report,sdslen(report),1,fp) == 1;
+    sdsfree(report);
+    if (fclose(fp) != 0) retval = 0;
+    return retval;
+}
+
+/* ============================================================================
+ * Connections pool.
  *
- *  ?s      -- TEXT field: char* argument.
- *  ?b      -- Blob field: char* argument followed by size_t argument.
- *  ?i      -- INT field : int64_t argument.
- *  ?d      -- REAL field: double argument.
+ * With WAL, SQLite can serve many concurrent readers while a single writer
+ * is active. A pool is a set of read only connections plus a single write
+ * connection for the same database file. Threads borrow a read only
+ * connection with sqlPoolGetReader(): the query functions in this file
+ * detect statements that are not read only and route them, automatically,
+ * to the write connection of the pool, serializing writers with a mutex.
+ * Transactions (BEGIN ... COMMIT/ROLLBACK/END) are executed entirely on
+ * the write connection, so that the thread sees its own writes.
+ * ==========================================================================*/
+
+#define SQL_POOL_MMAP_SIZE (256LL*1024*1024)
+#define SQL_POOL_BUSY_TIMEOUT 5000  /* Milliseconds. */
+
+/* Registered pools. They are created at startup, before any thread is
+ * started, and never released, so we can scan them without locking. */
+static sqlPool *SqlPools[SQL_MAX_POOLS];
+static int SqlNumPools = 0;
+
+/* Pool whose write connection the current thread has an open transaction
+ * with, if any. */
+static _Thread_local sqlPool *SqlTxPool = NULL;
+
+/* Last insert ID and number of changes of the last write query executed
+ * by this thread, captured while holding the writer lock. */
+static _Thread_local int64_t SqlLastInsertId = 0;
+static _Thread_local int SqlLastChanges = 0;
+
+/* Keys of the KV store cache modified by the transaction in progress,
+ * see kvCacheUpdate(). */
+static _Thread_local sds *SqlTxKeys = NULL;
+static _Thread_local int SqlTxNumKeys = 0;
+static _Thread_local memkv *SqlTxCache = NULL;
+static void kvCacheTxEnd(void);
+
+/* Set the options we want for all the connections of a pool. */
+static void sqlPoolSetupConnection(sqlite3 *db) {
+    char pragma[64];
+    sqlProfileAttach(db);
+    sqlite3_busy_timeout(db,SQL_POOL_BUSY_TIMEOUT);
+    snprintf(pragma,sizeof(pragma),"PRAGMA mmap_size=%lld",
+        SQL_POOL_MMAP_SIZE);
+    sqlite3_exec(db,pragma,0,0,NULL);
+}
+
+/* Open the database 'filename' creating a new pool. The write connection
+ * is opened immediately, the database is switched to WAL mode and, if
+ * not NULL, the 'createdb_query' is executed. Read only connections are
+ * opened on demand by sqlPoolGetReader(). Return NULL on error. */
+sqlPool *sqlPoolCreate(const char *filename, const char *createdb_query) {
+    sqlite3 *db;
+
+    if (SqlNumPools == SQL_MAX_POOLS) return NULL;
+    int rc = sqlite3_open_v2(filename,&db,SQLITE_OPEN_READWRITE|
+                             SQLITE_OPEN_CREATE|SQLITE_OPEN_FULLMUTEX,NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+    sqlPoolSetupConnection(db);
+    sqlite3_exec(db,"PRAGMA journal_mode=WAL",0,0,NULL);
+
+    if (createdb_query) {
+        char *errmsg;
+        rc = sqlite3_exec(db, createdb_query, 0, 0, &errmsg);
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "SQL error [%d]: %s\n", rc, errmsg);
+            sqlite3_free(errmsg);
+            sqlite3_close(db);
+            return NULL;
+        }
+    }
+
+    sqlPool *pool = xmalloc(sizeof(*pool));
+    const char *fn = sqlite3_db_filename(db,"main");
+    pool->filename = sdsnew(fn ? fn : "");
+    pool->writer = db;
+    pool->readers = NULL;
+    pool->numreaders = 0;
+    pool->kvcache = NULL;
+    pool->kvbloom = NULL;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&pool->writer_lock,&attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&pool->readers_lock,NULL);
+
+    SqlPools[SqlNumPools++] = pool;
+    return pool;
+}
+
+/* Return a read only connection from the pool, opening a new one if
+ * there are no idle connections. The connection must be returned to the
+ * pool with sqlPoolReleaseReader() once the thread is done with it.
+ * Return NULL on error. */
+sqlite3 *sqlPoolGetReader(sqlPool *pool) {
+    sqlite3 *db = NULL;
+
+    pthread_mutex_lock(&pool->readers_lock);
+    if (pool->numreaders) db = pool->readers[--pool->numreaders];
+    pthread_mutex_unlock(&pool->readers_lock);
+    if (db) return db;
+
+    int rc = sqlite3_open_v2(pool->filename,&db,SQLITE_OPEN_READONLY|
+                             SQLITE_OPEN_NOMUTEX,NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+    sqlPoolSetupConnection(db);
+    return db;
+}
+
+/* Put back a connection obtained with sqlPoolGetReader() into the
+ * pool of idle connections. */
+void sqlPoolReleaseReader(sqlPool *pool, sqlite3 *db) {
+    if (db == NULL) return;
+    pthread_mutex_lock(&pool->readers_lock);
+    pool->readers = xrealloc(pool->readers,
+                             sizeof(sqlite3*)*(pool->numreaders+1));
+    pool->readers[pool->numreaders++] = db;
+    pthread_mutex_unlock(&pool->readers_lock);
+}
+
+/* Return the pool the connection 'db' belongs to, or NULL if the
+ * connection was not obtained from a pool. Connections are matched by
+ * database file name, so a connection to the same file opened by other
+ * means is also routed via the pool. */
+sqlPool *sqlPoolOf(sqlite3 *db) {
+    if (SqlNumPools == 0) return NULL;
+    const char *fn = sqlite3_db_filename(db,"main");
+    if (fn == NULL || fn[0] == '\0') return NULL;
+    for (int j = 0; j < SqlNumPools; j++)
+        if (!strcmp(SqlPools[j]->filename,fn)) return SqlPools[j];
+    return NULL;
+}
+
+/* Types of queries from the point of view of routing. */
+#define SQL_KIND_READ 0     /* Candidate for read only connections. */
+#define SQL_KIND_WRITE 1    /* Anything else. */
+#define SQL_KIND_BEGIN 2    /* Starts a transaction. */
+#define SQL_KIND_END 3      /* Terminates a transaction. */
+
+/* Classify the query by its first keyword. Read queries are later
+ * verified with sqlite3_stmt_readonly(), but transaction control
+ * statements are reported as read only by SQLite, so we need to detect
+ * them in order to run the whole transaction on the write connection.
+ * SAVEPOINT outside a transaction starts one, like BEGIN, and RELEASE
+ * of the outermost savepoint commits it. */
+static int sqlQueryKind(const char *sql) {
+    while(isspace((unsigned char)*sql)) sql++;
+    if (!strncasecmp(sql,"SELECT",6) || !strncasecmp(sql,"WITH",4))
+        return SQL_KIND_READ;
+    if (!strncasecmp(sql,"BEGIN",5) || !strncasecmp(sql,"SAVEPOINT",9))
+        return SQL_KIND_BEGIN;
+    if (!strncasecmp(sql,"COMMIT",6) || !strncasecmp(sql,"END",3) ||
+        !strncasecmp(sql,"ROLLBACK",8) || !strncasecmp(sql,"RELEASE",7))
+        return SQL_KIND_END;
+    return SQL_KIND_WRITE;
+}
+
+/* Called after a statement was executed on the writer of 'pool' (the
+ * writer lock being held) to track the transaction state of the
+ * thread. Transactions keep the writer locked (the mutex is recursive)
+ * until they terminate, so that the writes of other threads can't end
+ * inside them. We don't trust the kind of the statement executed, but
+ * ask SQLite: a BEGIN may fail, a COMMIT may fail with SQLITE_BUSY
+ * leaving the transaction open, and errors may roll it back. */
+static void sqlTxUpdate(sqlPool *pool) {
+    int intx = !sqlite3_get_autocommit(pool->writer);
+    if (intx && SqlTxPool == NULL) {
+        pthread_mutex_lock(&pool->writer_lock);
+        SqlTxPool = pool;
+    } else if (!intx && SqlTxPool == pool) {
+        pthread_mutex_unlock(&pool->writer_lock);
+        SqlTxPool = NULL;
+    }
+}
+
+/* Prepare the query 'sql', selecting the right connection if 'dbhandle'
+ * belongs to a pool. On success SQLITE_OK is returned, '*stmtptr' is
+ * set to the prepared statement and '*lockedptr' is set to the pool
+ * whose writer lock was acquired (or NULL if the query is executed on a
+ * read only connection, or without any pool). */
+static int sqlPrepare(sqlite3 *dbhandle, const char *sql, sqlite3_stmt **stmtptr, sqlPool **lockedptr) {
+    sqlPool *pool = sqlPoolOf(dbhandle);
+    sqlite3 *db = dbhandle;
+    int rc;
+
+    *lockedptr = NULL;
+    if (pool) {
+        int kind = sqlQueryKind(sql);
+        if (kind != SQL_KIND_READ || SqlTxPool == pool ||
+            dbhandle == pool->writer)
+        {
+            pthread_mutex_lock(&pool->writer_lock);
+            *lockedptr = pool;
+            db = pool->writer;
+        }
+    }
+
+    rc = sqlite3_prepare_v2(db,sql,-1,stmtptr,NULL);
+    /* Queries looking like reads may write, like SELECT calling
+     * functions with side effects: in such case move to the writer. */
+    if (rc == SQLITE_OK && pool && *lockedptr == NULL &&
+        !sqlite3_stmt_readonly(*stmtptr))
+    {
+        sqlite3_finalize(*stmtptr);
+        pthread_mutex_lock(&pool->writer_lock);
+        *lockedptr = pool;
+        db = pool->writer;
+        rc = sqlite3_prepare_v2(db,sql,-1,stmtptr,NULL);
+    }
+
+    if (rc != SQLITE_OK) {
+        if (SHOW_QUERY_ERRORS) printf("%p: Query error: %s: %s\n",
+                                (void*)db,
+                                sql,
+                                sqlite3_errmsg(db));
+        if (*lockedptr) pthread_mutex_unlock(&pool->writer_lock);
+        *lockedptr = NULL;
+        *stmtptr = NULL;
+        return rc;
+    }
+    return SQLITE_OK;
+}
+
+/* ============================================================================
+ * Online backup.
+ * ==========================================================================*/
+
+#define SQL_BACKUP_MAX_RESTARTS 3
+
+/* Copy the database 'src' into the file 'dst' using the SQLite online
+ * backup API, while the database is in use. The copy is performed
+ * 'pages' pages at a time, sleeping 'sleep_ms' milliseconds after every
+ * step, so that the writers and the disk are not monopolized by the
+ * backup. The backup is written into a temporary file that is renamed
+ * as 'dst' only once complete, so 'dst' is always a consistent database.
+ *
+ * The function is blocking: it is meant to be called from a background
+ * thread. If 'stats' is not NULL, the number of pages copied and the
+ * duration of the backup are returned by reference.
+ *
+ * Returns SQLITE_OK on success, otherwise the SQLite error code. */
+int sqlBackup(const char *src, const char *dst, int pages, int sleep_ms, sqlBackupStats *stats) {
+    sqlite3 *srcdb = NULL, *dstdb = NULL;
+    sqlite3_backup *bk = NULL;
+    sds tmpfile = sdscatprintf(sdsempty(),"%s.tmp",dst);
+    uint64_t start = sqlProfUstime();
+    int rc;
+
+    if (stats) memset(stats,0,sizeof(*stats));
+    unlink(tmpfile);
+    rc = sqlite3_open_v2(src,&srcdb,SQLITE_OPEN_READONLY,NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    rc = sqlite3_open_v2(tmpfile,&dstdb,
+                         SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE,NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    sqlite3_busy_timeout(srcdb,SQL_POOL_BUSY_TIMEOUT);
+
+    /* In WAL mode, hold a read transaction on the source for the whole
+     * backup: this gives us a stable snapshot, otherwise every write
+     * performed by the bot between two steps would restart the backup
+     * from scratch. With a rollback journal we can't do that, since the
+     * shared lock would make every write of the bot fail with
+     * SQLITE_BUSY for the duration of the backup: in such case the
+     * backup restarts when the source is modified, and if this happens
+     * SQL_BACKUP_MAX_RESTARTS times we give up pacing and copy all the
+     * pages in a single step, so that busy databases are still saved. */
+    int wal = 0;
+    sqlite3_stmt *stmt;
+    rc = sqlite3_prepare_v2(srcdb,"PRAGMA journal_mode",-1,&stmt,NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *mode = (const char*)sqlite3_column_text(stmt,0);
+        wal = mode && !strcasecmp(mode,"wal");
+    }
+    sqlite3_finalize(stmt);
+    if (wal) {
+        rc = sqlite3_exec(srcdb,"BEGIN; SELECT COUNT(*) FROM sqlite_master;",
+                          0,0,NULL);
+        if (rc != SQLITE_OK) goto cleanup;
+    }
+
+    bk = sqlite3_backup_init(dstdb,"main",srcdb,"main");
+    if (bk == NULL) {
+        rc = sqlite3_errcode(dstdb);
+        goto cleanup;
+    }
+    int restarts = 0, remaining = -1;
+    do {
+        rc = sqlite3_backup_step(bk,pages);
+        if (!wal && remaining != -1 &&
+            sqlite3_backup_remaining(bk) > remaining &&
+            ++restarts == SQL_BACKUP_MAX_RESTARTS) pages = -1;
+        remaining = sqlite3_backup_remaining(bk);
+        if (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED)
+            usleep(sleep_ms*1000);
+    } while(rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+    if (stats) {
+        /* Note that we don't use the wrapper here, since the pool would
+         * route the PRAGMA to the writer. */
+        stats->pages = sqlite3_backup_pagecount(bk);
+        if (sqlite3_prepare_v2(srcdb,"PRAGMA page_size",-1,&stmt,NULL) ==
+            SQLITE_OK)
+        {
+            if (sqlite3_step(stmt) == SQLITE_ROW)
+                stats->bytes = stats->pages*sqlite3_column_int64(stmt,0);
+            sqlite3_finalize(stmt);
+        }
+    }
+    sqlite3_backup_finish(bk);
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+
+cleanup:
+    if (srcdb && !sqlite3_get_autocommit(srcdb))
+        sqlite3_exec(srcdb,"COMMIT",0,0,NULL);
+    sqlite3_close(srcdb);
+    sqlite3_close(dstdb);
+    if (rc == SQLITE_OK && rename(tmpfile,dst) == -1) rc = SQLITE_CANTOPEN;
+    if (rc != SQLITE_OK) unlink(tmpfile);
+    sdsfree(tmpfile);
+    if (stats) stats->duration_us = sqlProfUstime()-start;
+    return rc;
+}
+
+/* This is the low level function that we use to model all the higher level
+ * functions: the query is executed binding the 'argc' arguments in the
+ * 'argv' array to the "?" placeholders of the SQL statement, in order.
+ * No format parsing is performed here: the query is passed as it is to
+ * SQLite, and the arguments are already typed. Usually this is called
+ * via the sqlQueryArgs() family of macros (see sqlite_wrap.h), that
+ * build the arguments array at compile time, checking the C types of the
+ * arguments passed.
  *
  * The function returns the return code of the last SQLite query that
  * failed on error. On success it returns what sqlite3_step() returns.
@@ -36,9 +620,79 @@
  * Note that is valid to call sqlEnd() even if the query didn't return
  * SQLITE_ROW, since in such case row->stmt is set to NULL.
  */
-int sqlGenericQuery(sqlite3 *dbhandle, sqlRow *row, const char *sql, va_list ap) {
+int sqlGenericQueryArgv(sqlite3 *dbhandle, sqlRow *row, const char *sql, const sqlArg *argv, int argc) {
     int rc = SQLITE_ERROR;
     sqlite3_stmt *stmt = NULL;
+    if (row) row->stmt = NULL; /* On error sqlNextRow() should return false. */
+
+    /* Prepare the query and bind the query arguments. */
+    sqlPool *locked;
+    rc = sqlPrepare(dbhandle,sql,&stmt,&locked);
+    if (rc != SQLITE_OK) return rc;
+
+    for (int j = 0; j < argc; j++) {
+        const sqlArg *a = argv+j;
+        switch(a->type) {
+        case SQLITE_BLOB: rc = sqlite3_bind_blob64(stmt,j+1,a->s,a->i,NULL);
+                          break;
+        case SQLITE_TEXT: rc = sqlite3_bind_text(stmt,j+1,a->s,-1,NULL);
+                          break;
+        case SQLITE_INTEGER: rc = sqlite3_bind_int64(stmt,j+1,a->i);
+                          break;
+        case SQLITE_FLOAT: rc = sqlite3_bind_double(stmt,j+1,a->d);
+                          break;
+        case SQL_ARG_INVALID: rc = SQLITE_RANGE;
+                          break;
+        default:          rc = sqlite3_bind_null(stmt,j+1);
+                          break;
+        }
+        if (rc != SQLITE_OK) goto error;
+    }
+
+    /* Execute. */
+    rc = sqlite3_step(stmt);
+    if (locked) sqlTxUpdate(locked);
+    if (rc == SQLITE_ROW) {
+        if (row) {
+            row->stmt = stmt;
+            row->cols = 0;
+            row->col = NULL;
+            row->locked = locked;
+            stmt = NULL; /* Don't free it on cleanup. */
+            locked = NULL; /* sqlEnd() will release the writer. */
+        }
+    } else if (rc == SQLITE_DONE) {
+        sqlite3 *db = sqlite3_db_handle(stmt);
+        SqlLastInsertId = sqlite3_last_insert_rowid(db);
+        SqlLastChanges = sqlite3_changes(db);
+    }
+    /* If a transaction just terminated, invalidate the cached keys it
+     * modified. */
+    if (SqlTxNumKeys && SqlTxPool == NULL) kvCacheTxEnd();
+
+error:
+    if (stmt) sqlite3_finalize(stmt);
+    if (locked) pthread_mutex_unlock(&locked->writer_lock);
+    return rc;
+}
+
+/* Like sqlGenericQueryArgv(), but the arguments are taken from a va_list
+ * according to the specifiers found in the query.
+ *
+ * Queries can contain ?s ?b ?i and ?d special specifiers that are bound to
+ * the SQL query, and must be present later as additional arguments after
+ * the 'sql' argument.
+ *
+ *  ?s      -- TEXT field: char* argument.
+ *  ?b      -- Blob field: char* argument followed by size_t argument.
+ *  ?i      -- INT field : int64_t argument.
+ *  ?d      -- REAL field: double argument.
+ *
+ * Note that here the types can't be checked by the compiler: passing an
+ * 'int' where an int64_t is expected is undefined behavior. New code
+ * should prefer the sqlQueryArgs() family of macros. */
+int sqlGenericQuery(sqlite3 *dbhandle, sqlRow *row, const char *sql, va_list ap) {
+    int rc = SQLITE_ERROR;
     sds query = sdsempty();
     if (row) row->stmt = NULL; /* On error sqlNextRow() should return false. */
 
@@ -52,17 +706,30 @@ int sqlGenericQuery(sqlite3 *dbhandle, sqlRow *row, const char *sql, va_list ap)
      * ?i int64_t
      * ?d double
      */
-    char spec[SQL_MAX_SPEC];
+    sqlArg args[SQL_MAX_SPEC];
     int numspec = 0;
     const char *p = sql;
     while(p[0]) {
         if (p[0] == '?') {
-            if (p[1] == 's' || p[1] == 'i' || p[1] == 'd' || p[1] == 'b') {
-                if (numspec == SQL_MAX_SPEC) goto error;
-                spec[numspec++] = p[1];
-            } else {
-                goto error;
+            if (numspec == SQL_MAX_SPEC) goto error;
+            sqlArg *a = args+numspec;
+            switch(p[1]) {
+            case 'b': a->type = SQLITE_BLOB;
+                      a->s = va_arg(ap,char*);
+                      a->i = va_arg(ap,size_t);
+                      break;
+            case 's': a->type = SQLITE_TEXT;
+                      a->s = va_arg(ap,char*);
+                      break;
+            case 'i': a->type = SQLITE_INTEGER;
+                      a->i = va_arg(ap,int64_t);
+                      break;
+            case 'd': a->type = SQLITE_FLOAT;
+                      a->d = va_arg(ap,double);
+                      break;
+            default: goto error;
             }
+            numspec++;
             query = sdscatlen(query,"?",1);
             p++; /* Skip the specifier. */
         } else {
@@ -70,48 +737,9 @@ int sqlGenericQuery(sqlite3 *dbhandle, sqlRow *row, const char *sql, va_list ap)
         }
         p++;
     }
-
-    /* Prepare the query and bind the query arguments. */
-    rc = sqlite3_prepare_v2(dbhandle,query,-1,&stmt,NULL);
-    if (rc != SQLITE_OK) {
-        if (SHOW_QUERY_ERRORS) printf("%p: Query error: %s: %s\n",
-                                (void*)dbhandle,
-                                query,
-                                sqlite3_errmsg(dbhandle));
-        goto error;
-    }
-
-    for (int j = 0; j < numspec; j++) {
-        switch(spec[j]) {
-        case 'b': {
-                  char *blobptr = va_arg(ap,char*);
-                  size_t bloblen = va_arg(ap,size_t);
-                  rc = sqlite3_bind_blob64(stmt,j+1,blobptr,bloblen,NULL);
-                  }
-                  break;
-        case 's': rc = sqlite3_bind_text(stmt,j+1,va_arg(ap,char*),-1,NULL);
-                  break;
-        case 'i': rc = sqlite3_bind_int64(stmt,j+1,va_arg(ap,int64_t));
-                  break;
-        case 'd': rc = sqlite3_bind_double(stmt,j+1,va_arg(ap,double));
-                  break;
-        }
-        if (rc != SQLITE_OK) goto error;
-    }
-
-    /* Execute. */
-    rc = sqlite3_step(stmt);
-    if (rc == SQLITE_ROW) {
-        if (row) {
-            row->stmt = stmt;
-            row->cols = 0;
-            row->col = NULL;
-            stmt = NULL; /* Don't free it on cleanup. */
-        }
-    }
+    rc = sqlGenericQueryArgv(dbhandle,row,query,args,numspec);
 
 error:
-    if (stmt) sqlite3_finalize(stmt);
     sdsfree(query);
     return rc;
 }
@@ -122,16 +750,41 @@ void sqlEnd(sqlRow *row) {
     if (row->stmt == NULL) return;
     xfree(row->col);
     sqlite3_finalize(row->stmt);
+    if (row->locked) pthread_mutex_unlock(&row->locked->writer_lock);
     row->col = NULL;
     row->stmt = NULL;
+    row->locked = NULL;
 }
 
-/* After sqlGenericQuery() returns SQLITE_ROW, you can call this function
- * with the 'row' object pointer in order to get the rows composing the
- * result set. It returns 1 if the next row is available, otherwise 0
- * is returned (and the row object is freed). If you stop the iteration
- * before all the elements are used, you need to call sqlEnd(). */
-int sqlNextRow(sqlRow *row) {
+/* Convert the column 'idx' of the current row into the row->col[idx]
+ * sqlCol structure. */
+static void sqlDecodeColumn(sqlRow *row, int idx) {
+    sqlCol *c = row->col+idx;
+    c->type = sqlite3_column_type(row->stmt,idx);
+    if (c->type == SQLITE_INTEGER) {
+        c->i = sqlite3_column_int64(row->stmt,idx);
+    } else if (c->type == SQLITE_FLOAT) {
+        c->d = sqlite3_column_double(row->stmt,idx);
+    } else if (c->type == SQLITE_TEXT) {
+        c->s = (char*)sqlite3_column_text(row->stmt,idx);
+        c->i = sqlite3_column_bytes(row->stmt,idx);
+    } else if (c->type == SQLITE_BLOB) {
+        c->s = sqlite3_column_blob(row->stmt,idx);
+        c->i = sqlite3_column_bytes(row->stmt,idx);
+    } else {
+        /* SQLITE_NULL. */
+        c->s = NULL;
+        c->i = 0;
+        c->d = 0;
+    }
+}
+
+/* Move the row object to the next row, without decoding any column.
+ * The columns array is allocated only the first time: the number of
+ * columns of a prepared statement can't change between rows, so the same
+ * buffer is reused for the whole iteration. Returns 1 if there is a row
+ * available, otherwise 0 is returned and the row object is freed. */
+static int sqlStepRow(sqlRow *row) {
     if (row->stmt == NULL) return 0;
 
     if (row->col != NULL) {
@@ -139,33 +792,45 @@ int sqlNextRow(sqlRow *row) {
             sqlEnd(row);
             return 0;
         }
+    } else {
+        row->cols = sqlite3_data_count(row->stmt);
+        /* Allocate at least one element: a non NULL 'col' is what tells
+         * us that the first row was already returned. */
+        row->col = xmalloc((row->cols ? row->cols : 1)*sizeof(sqlCol));
     }
+    return 1;
+}
 
-    xfree(row->col);
-    row->cols = sqlite3_data_count(row->stmt);
-    row->col = xmalloc(row->cols*sizeof(sqlCol));
-    for (int j = 0; j < row->cols; j++) {
-        row->col[j].type = sqlite3_column_type(row->stmt,j);
-        if (row->col[j].type == SQLITE_INTEGER) {
-            row->col[j].i = sqlite3_column_int64(row->stmt,j);
-        } else if (row->col[j].type == SQLITE_FLOAT) {
-            row->col[j].d = sqlite3_column_double(row->stmt,j);
-        } else if (row->col[j].type == SQLITE_TEXT) {
-            row->col[j].s = (char*)sqlite3_column_text(row->stmt,j);
-            row->col[j].i = sqlite3_column_bytes(row->stmt,j);
-        } else if (row->col[j].type == SQLITE_BLOB) {
-            row->col[j].s = sqlite3_column_blob(row->stmt,j);
-            row->col[j].i = sqlite3_column_bytes(row->stmt,j);
-        } else {
-            /* SQLITE_NULL. */
-            row->col[j].s = NULL;
-            row->col[j].i = 0;
-            row->col[j].d = 0;
-        }
-    }
+/* After sqlGenericQuery() returns SQLITE_ROW, you can call this function
+ * with the 'row' object pointer in order to get the rows composing the
+ * result set. It returns 1 if the next row is available, otherwise 0
+ * is returned (and the row object is freed). If you stop the iteration
+ * before all the elements are used, you need to call sqlEnd(). */
+int sqlNextRow(sqlRow *row) {
+    if (!sqlStepRow(row)) return 0;
+    for (int j = 0; j < row->cols; j++) sqlDecodeColumn(row,j);
     return 1;
 }
 
+/* Like sqlNextRow() but no column is converted: the caller should
+ * access the columns it needs with sqlColumn(). This is useful when
+ * scanning many rows of tables having many columns, or when only some
+ * row is actually inspected, since the conversion of text and blobs may
+ * be costly. Note that in this mode the content of row->col[] is only
+ * valid for columns obtained via sqlColumn() in the current row. */
+int sqlNextRowLazy(sqlRow *row) {
+    return sqlStepRow(row);
+}
+
+/* Return the column 'idx' of the current row, converting it on demand.
+ * Can be used both after sqlNextRow() and sqlNextRowLazy(). Returns NULL
+ * if the index is out of range. */
+sqlCol *sqlColumn(sqlRow *row, int idx) {
+    if (row->stmt == NULL || idx < 0 || idx >= row->cols) return NULL;
+    sqlDecodeColumn(row,idx);
+    return row->col+idx;
+}
+
 /* Wrapper for sqlGenericQuery() returning the last inserted ID or 0
  * on error. */
 int sqlInsert(sqlite3 *dbhandle, const char *sql, ...) {
@@ -173,7 +838,7 @@ int sqlInsert(sqlite3 *dbhandle, const char *sql, ...) {
     va_list ap;
     va_start(ap,sql);
     int rc = sqlGenericQuery(dbhandle,NULL,sql,ap);
-    if (rc == SQLITE_DONE) lastid = sqlite3_last_insert_rowid(dbhandle);
+    if (rc == SQLITE_DONE) lastid = SqlLastInsertId;
     va_end(ap);
     return lastid;
 }
@@ -231,26 +896,363 @@ int64_t sqlSelectInt(sqlite3 *dbhandle, const char *sql, ...) {
     return i;
 }
 
+/* The following functions are the same as the above wrappers, but
+ * take an already typed array of arguments: see sqlGenericQueryArgv().
+ * They are usually not called directly, but via the sqlQueryArgs() and
+ * similar macros defined in sqlite_wrap.h. */
+int sqlInsertArgv(sqlite3 *dbhandle, const char *sql, const sqlArg *argv, int argc) {
+    int rc = sqlGenericQueryArgv(dbhandle,NULL,sql,argv,argc);
+    return rc == SQLITE_DONE ? SqlLastInsertId : 0;
+}
+
+int sqlQueryArgv(sqlite3 *dbhandle, const char *sql, const sqlArg *argv, int argc) {
+    return sqlGenericQueryArgv(dbhandle,NULL,sql,argv,argc) == SQLITE_DONE;
+}
+
+int sqlSelectArgv(sqlite3 *dbhandle, sqlRow *row, const char *sql, const sqlArg *argv, int argc) {
+    return sqlGenericQueryArgv(dbhandle,row,sql,argv,argc);
+}
+
+int sqlSelectOneRowArgv(sqlite3 *dbhandle, sqlRow *row, const char *sql, const sqlArg *argv, int argc) {
+    int rc = sqlGenericQueryArgv(dbhandle,row,sql,argv,argc);
+    if (rc == SQLITE_ROW) sqlNextRow(row);
+    return rc;
+}
+
+int64_t sqlSelectIntArgv(sqlite3 *dbhandle, const char *sql, const sqlArg *argv, int argc) {
+    sqlRow row;
+    int64_t i = 0;
+    int rc = sqlGenericQueryArgv(dbhandle,&row,sql,argv,argc);
+    if (rc == SQLITE_ROW) {
+        sqlNextRowLazy(&row);
+        i = sqlColumn(&row,0)->i;
+        sqlEnd(&row);
+    }
+    return i;
+}
+
 /* ==========================================================================
  * Key value store abstraction. This implements a trivial KV store on top
  * of SQLite. It only has SET, GET, DEL and support for a maximum time to live.
  * ======================================================================== */
 
+/* The KV store can have, for each pool, a write-through cache of the
+ * keys in memory (see memkv.c). Writes update the cache while holding the
+ * pool writer lock, so the cache and the database are updated in the same
+ * order. Writes performed inside a transaction can't update the cache,
+ * since the transaction may be rolled back: the keys are removed from the
+ * cache instead, and removed again once the transaction terminates, since
+ * in the meantime other threads may have populated the cache with the old
+ * value. */
+
+/* Return the KV cache of the pool, or NULL if the cache is disabled. */
+static memkv *kvCacheOf(sqlPool *pool) {
+    return pool ? pool->kvcache : NULL;
+}
+
+/* Called after a write to the key is performed in the database, with the
+ * writer lock held. If 'value' is NULL the key was deleted. */
+static void kvCacheUpdate(sqlPool *pool, const char *key, const char *value, size_t vlen, int64_t expire) {
+    memkv *cache = kvCacheOf(pool);
+    if (cache == NULL) return;
+    if (SqlTxPool == pool) {
+        memkvDel(cache,key);
+        SqlTxKeys = xrealloc(SqlTxKeys,sizeof(sds)*(SqlTxNumKeys+1));
+        SqlTxKeys[SqlTxNumKeys++] = sdsnew(key);
+        SqlTxCache = cache;
+    } else if (value) {
+        memkvSet(cache,key,value,vlen,expire);
+    } else {
+        memkvDel(cache,key);
+    }
+}
+
+/* Invalidate the keys written by the transaction that just terminated. */
+static void kvCacheTxEnd(void) {
+    for (int j = 0; j < SqlTxNumKeys; j++) {
+        memkvDel(SqlTxCache,SqlTxKeys[j]);
+        sdsfree(SqlTxKeys[j]);
+    }
+    xfree(SqlTxKeys);
+    SqlTxKeys = NULL;
+    SqlTxNumKeys = 0;
+    SqlTxCache = NULL;
+}
+
+/* Lock the writer of the pool, if any. This is needed when the KV cache
+ * or the keys filter are enabled, so that the write to the database and
+ * the update of the cache / filter are performed atomically. */
+static void kvLockWriter(sqlPool *pool) {
+    if (kvCacheOf(pool) || (pool && pool->kvbloom))
+        pthread_mutex_lock(&pool->writer_lock);
+}
+
+static void kvUnlockWriter(sqlPool *pool) {
+    if (kvCacheOf(pool) || (pool && pool->kvbloom))
+        pthread_mutex_unlock(&pool->writer_lock);
+}
+
+/* Keys filter. When enabled with kvBloomEnable(), every pool keeps a
+ * counting Bloom filter (see bloom.c) of the keys existing in the KeyValue
+ * table, so that kvGet() of a key that does not exist, that in many bots
+ * is the most common case, usually returns without querying SQLite. The
+ * filter is built scanning the table, and then updated by the kv*()
+ * functions while holding the writer lock. Keys written inside a
+ * transaction are added (if the transaction is rolled back, the stale
+ * entries just cause some false positive), but keys deleted inside a
+ * transaction are not removed, since a rollback would make them exist
+ * again while the filter reports them as missing. For the same reason,
+ * when the filter is enabled, the KeyValue table should only be modified
+ * via the kv*() functions. */
+
+/* Return the filter of the pool if enabled, or NULL. */
+static bloom *kvBloomOf(sqlPool *pool) {
+    return pool ? pool->kvbloom : NULL;
+}
+
+/* Called with the writer lock held before writing 'key': if the write
+ * will create the key, add it to the filter and return 1. The key must be
+ * added before the write, since readers don't take the writer lock: once
+ * committed, the key must never be reported as missing. If the write
+ * fails, the caller should remove the key from the filter again, since
+ * the key was not created (and the writer lock is still held).
+ *
+ * The existence check runs on the writer, not on the caller connection:
+ * a reader of the same thread with a statement in progress could see an
+ * older snapshot where the key still exists, and the key would not be
+ * added. */
+static int kvBloomAddNewKey(sqlPool *pool, const char *key) {
+    bloom *b = kvBloomOf(pool);
+    if (b == NULL) return 0;
+    if (bloomProbe(b,key) && sqlSelectIntArgs(pool->writer,
+        "SELECT COUNT(*) FROM KeyValue WHERE key=?",key) != 0) return 0;
+    bloomAdd(b,key);
+    return 1;
+}
+
+/* Called with the writer lock held after the key was deleted. */
+static void kvBloomDeleted(sqlPool *pool, const char *key) {
+    bloom *b = kvBloomOf(pool);
+    if (b && SqlTxPool != pool) bloomRemove(b,key);
+}
+
+/* Enable the keys filter for the database of the connection, building it
+ * from the keys currently in the KeyValue table. Only works with the
+ * connections pool (see sqlPoolCreate()). Should be called at startup,
+ * before other threads use the database. Return 1 on success, 0 if the
+ * connection is not part of a pool or the KeyValue table does not
+ * exist. */
+int kvBloomEnable(sqlite3 *dbhandle) {
+    sqlPool *pool = sqlPoolOf(dbhandle);
+    sqlRow row;
+    if (pool == NULL || pool->kvbloom) return pool != NULL;
+    if (!sqlSelectIntArgs(dbhandle,
+        "SELECT COUNT(*) FROM sqlite_master WHERE type=? AND name=?",
+        "table","KeyValue")) return 0;
+
+    int64_t numkeys = sqlSelectInt(dbhandle,"SELECT COUNT(*) FROM KeyValue");
+    bloom *b = bloomCreate(numkeys);
+    sqlSelect(dbhandle,&row,"SELECT key FROM KeyValue");
+    while(sqlNextRowLazy(&row)) {
+        sqlCol *c = sqlColumn(&row,0);
+        if (c->type == SQLITE_TEXT) bloomAdd(b,c->s);
+    }
+    pool->kvbloom = b;
+    return 1;
+}
+
+/* Return the statistics of the keys filter as an SDS string the caller
+ * should free. If the filter is disabled, an empty string is returned. */
+sds kvBloomInfo(sqlite3 *dbhandle) {
+    bloom *b = kvBloomOf(sqlPoolOf(dbhandle));
+    sds info = sdsempty();
+    if (b) info = bloomInfo(b,info);
+    return info;
+}
+
+/* Return the value column of the KeyValue table as an SDS string. Values
+ * are usually blobs, but counters (see kvIncrBy()) are stored as integers,
+ * and returned in their decimal representation. */
+static sds kvValueFromCol(sqlCol *c) {
+    if (c->type == SQLITE_INTEGER) return sdsfromlonglong(c->i);
+    if (c->type == SQLITE_FLOAT) return sdscatprintf(sdsempty(),"%.17g",c->d);
+    if (c->type == SQLITE_NULL) return sdsempty();
+    return sdsnewlen(c->s,c->i);
+}
+
+/* Values compression. When enabled with kvSetCompression(), values of
+ * at least the configured size are compressed with LZF before being
+ * written. Stored values are tagged with a header, so that rows written
+ * before enabling compression (or with compression disabled) are still
+ * read correctly:
+ *
+ *  "\0LZF" 'Z' <uncompressed length: 4 bytes, little endian> <LZF data>
+ *  "\0LZF" 'R' <raw value>
+ *
+ * Values without the magic are stored and read as they are. The 'R' form
+ * is only used for the (unlikely) raw values that happen to start with
+ * the magic, so that they are not mistaken for compressed values. Values
+ * are compressed only if this saves at least 1/8 of the space: otherwise
+ * the CPU time to decompress them at every access is not worth it. The
+ * KV cache always holds uncompressed values. */
+#define KV_COMPRESS_MAGIC "\0LZF"
+#define KV_COMPRESS_MAGIC_LEN 4
+#define KV_COMPRESS_HDR_LEN (KV_COMPRESS_MAGIC_LEN+5)
+
+static size_t KvCompressThreshold = 0;  /* Min value size, 0 = disabled. */
+static pthread_mutex_t KvCompressLock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    uint64_t compressed;        /* Values stored compressed. */
+    uint64_t incompressible;    /* Values stored raw, not worth it. */
+    uint64_t decompressed;      /* Compressed values read. */
+    uint64_t bytes_in;          /* Uncompressed size of compressed values. */
+    uint64_t bytes_out;         /* Compressed size of the same values. */
+    uint64_t compress_us;       /* Time spent compressing. */
+    uint64_t decompress_us;     /* Time spent decompressing. */
+} KvCompressStats;
+
+/* Compress the values of 'threshold' bytes or more. Zero disables the
+ * compression (but compressed values are still read). */
+void kvSetCompression(size_t threshold) {
+    KvCompressThreshold = threshold;
+}
+
+/* Return the value to store in the database for 'value': NULL if the
+ * value should be stored as it is, otherwise the SDS string with the
+ * tagged (and possibly compressed) value. */
+static sds kvEncodeValue(const char *value, size_t vlen) {
+    int tagged = vlen >= KV_COMPRESS_MAGIC_LEN &&
+                 !memcmp(value,KV_COMPRESS_MAGIC,KV_COMPRESS_MAGIC_LEN);
+
+    if (KvCompressThreshold && vlen >= KvCompressThreshold &&
+        vlen/8 > KV_COMPRESS_HDR_LEN && vlen <= UINT32_MAX)
+    {
+        size_t maxlen = vlen-vlen/8-KV_COMPRESS_HDR_LEN;
+        uint64_t start = sqlProfUstime();
+        sds enc = sdsnewlen(NULL,KV_COMPRESS_HDR_LEN+maxlen);
+        size_t clen = lzfCompress(value,vlen,enc+KV_COMPRESS_HDR_LEN,maxlen);
+        uint64_t elapsed = sqlProfUstime()-start;
+
+        pthread_mutex_lock(&KvCompressLock);
+        KvCompressStats.compress_us += elapsed;
+        if (clen) {
+            KvCompressStats.compressed++;
+            KvCompressStats.bytes_in += vlen;
+            KvCompressStats.bytes_out += KV_COMPRESS_HDR_LEN+clen;
+        } else {
+            KvCompressStats.incompressible++;
+        }
+        pthread_mutex_unlock(&KvCompressLock);
+
+        if (clen) {
+            memcpy(enc,KV_COMPRESS_MAGIC,KV_COMPRESS_MAGIC_LEN);
+            enc[KV_COMPRESS_MAGIC_LEN] = 'Z';
+            for (int j = 0; j < 4; j++)
+                enc[KV_COMPRESS_MAGIC_LEN+1+j] = (vlen >> (j*8)) & 0xff;
+            sdssetlen(enc,KV_COMPRESS_HDR_LEN+clen);
+            return enc;
+        }
+        sdsfree(enc);
+    }
+
+    if (!tagged) return NULL;
+    sds enc = sdsnewlen(KV_COMPRESS_MAGIC "R",KV_COMPRESS_MAGIC_LEN+1);
+    return sdscatlen(enc,value,vlen);
+}
+
+/* Like kvValueFromCol(), but handles the tagged values written by
+ * kvEncodeValue(). Returns NULL if a compressed value is corrupted. */
+static sds kvDecodeValue(sqlCol *c) {
+    if ((c->type != SQLITE_BLOB && c->type != SQLITE_TEXT) ||
+        c->i <= KV_COMPRESS_MAGIC_LEN ||
+        memcmp(c->s,KV_COMPRESS_MAGIC,KV_COMPRESS_MAGIC_LEN))
+    {
+        return kvValueFromCol(c);
+    }
+
+    const unsigned char *p = (const unsigned char*)c->s+KV_COMPRESS_MAGIC_LEN;
+    if (p[0] == 'R')
+        return sdsnewlen(p+1,c->i-KV_COMPRESS_MAGIC_LEN-1);
+    if (p[0] != 'Z' || c->i < KV_COMPRESS_HDR_LEN) {
+        printf("Corrupted KV value: unknown header\n");
+        return NULL;
+    }
+
+    size_t vlen = (size_t)p[1] | ((size_t)p[2] << 8) |
+                  ((size_t)p[3] << 16) | ((size_t)p[4] << 24);
+    uint64_t start = sqlProfUstime();
+    sds value = sdsnewlen(NULL,vlen);
+    size_t dlen = lzfDecompress(c->s+KV_COMPRESS_HDR_LEN,
+                                c->i-KV_COMPRESS_HDR_LEN,value,vlen);
+    uint64_t elapsed = sqlProfUstime()-start;
+    pthread_mutex_lock(&KvCompressLock);
+    KvCompressStats.decompressed++;
+    KvCompressStats.decompress_us += elapsed;
+    pthread_mutex_unlock(&KvCompressLock);
+
+    if (dlen != vlen) {
+        printf("Corrupted KV value: LZF decompression failed\n");
+        sdsfree(value);
+        return NULL;
+    }
+    return value;
+}
+
+/* Return the compression statistics as an SDS string the caller should
+ * free. */
+sds kvCompressionInfo(void) {
+    pthread_mutex_lock(&KvCompressLock);
+    sds info = sdscatprintf(sdsempty(),
+        "threshold:%zu\n"
+        "compressed_values:%llu\n"
+        "incompressible_values:%llu\n"
+        "decompressed_values:%llu\n"
+        "compressed_bytes_in:%llu\n"
+        "compressed_bytes_out:%llu\n"
+        "compression_ratio:%.3f\n"
+        "compress_us_per_kb:%.3f\n"
+        "decompress_us_per_value:%.3f\n",
+        KvCompressThreshold,
+        (unsigned long long)KvCompressStats.compressed,
+        (unsigned long long)KvCompressStats.incompressible,
+        (unsigned long long)KvCompressStats.decompressed,
+        (unsigned long long)KvCompressStats.bytes_in,
+        (unsigned long long)KvCompressStats.bytes_out,
+        KvCompressStats.bytes_out ?
+            (double)KvCompressStats.bytes_in/KvCompressStats.bytes_out : 0,
+        KvCompressStats.bytes_in ?
+            (double)KvCompressStats.compress_us*1024/
+                KvCompressStats.bytes_in : 0,
+        KvCompressStats.decompressed ?
+            (double)KvCompressStats.decompress_us/
+                KvCompressStats.decompressed : 0);
+    pthread_mutex_unlock(&KvCompressLock);
+    return info;
+}
+
 /* Set the key to the specified value and expire time. An expire of zero
  * means the key should not be expired at all. Return 1 on success, or
  * 0 on error. */
 int kvSetLen(sqlite3 *dbhandle, const char *key, const char *value, size_t vlen, int64_t expire) {
+    sqlPool *pool = sqlPoolOf(dbhandle);
+    int retval;
+
     if (expire) expire += time(NULL);
-    if (!sqlInsert(dbhandle,"INSERT INTO KeyValue VALUES(?i,?s,?b)",
-                   expire,key,value,vlen))
-    {
-        if (!sqlQuery(dbhandle,"UPDATE KeyValue SET expire=?i,value=?b WHERE key=?s",
-                      expire,value,vlen,key))
-        {
-            return 0;
-        }
-    }
-    return 1;
+    sds enc = kvEncodeValue(value,vlen);
+    kvLockWriter(pool);
+    int newkey = kvBloomAddNewKey(pool,key);
+    retval = sqlQueryArgs(dbhandle,
+        "INSERT INTO KeyValue VALUES(?,?,?) ON CONFLICT(key) DO UPDATE "
+        "SET expire=excluded.expire, value=excluded.value",
+        expire,key,enc ? SQL_BLOB(enc,sdslen(enc)) : SQL_BLOB(value,vlen));
+    sdsfree(enc);
+    if (!retval && newkey) bloomRemove(kvBloomOf(pool),key);
+    if (retval)
+        kvCacheUpdate(pool,key,value,vlen,expire);
+    else
+        kvCacheUpdate(pool,key,NULL,0,0);
+    kvUnlockWriter(pool);
+    return retval;
 }
 
 /* Wrapper where the value len is obtained via strlen().*/
@@ -261,22 +1263,886 @@ int kvSet(sqlite3 *dbhandle,const char *key, const char *value, int64_t expire)
 /* Get the specified key and return it as an SDS string. If the value is
  * expired or does not exist NULL is returned. */
 sds kvGet(sqlite3 *dbhandle,const char *key) {
+    sqlPool *pool = sqlPoolOf(dbhandle);
+    memkv *cache = kvCacheOf(pool);
+    /* Inside a transaction we read from the writer, that sees the
+     * uncommitted writes: they can't be cached, and the cache may have
+     * values older than the ones we wrote. */
+    if (pool && SqlTxPool == pool) cache = NULL;
+    uint64_t gen = 0;
+    int64_t expire = 0;
     sds value = NULL;
     sqlRow row;
-    sqlSelect(dbhandle,&row,"SELECT expire,value FROM KeyValue WHERE key=?s",key);
+
+    if (cache) {
+        value = memkvGet(cache,key,&gen);
+        if (value) return value;
+    }
+    bloom *b = kvBloomOf(pool);
+    if (b && !bloomMaybe(b,key)) return NULL;
+
+    int found = 0;
+    sqlSelectArgs(dbhandle,&row,"SELECT expire,value FROM KeyValue WHERE key=?",key);
     if (sqlNextRow(&row)) {
-        int64_t expire = row.col[0].i;
+        found = 1;
+        expire = row.col[0].i;
         if (expire && expire < time(NULL)) {
-            sqlQuery(dbhandle,"DELETE FROM KeyValue WHERE key=?s",key);
+            /* Delete the key only if it was not set again in the
+             * meantime by some other thread. */
+            sqlEnd(&row);
+            kvLockWriter(pool);
+            if (sqlQueryArgs(dbhandle,
+                "DELETE FROM KeyValue WHERE key=? AND expire=?",key,expire)
+                && SqlLastChanges) kvBloomDeleted(pool,key);
+            kvUnlockWriter(pool);
+            expire = 0;
         } else {
-            value = sdsnewlen(row.col[1].s,row.col[1].i);
+            value = kvDecodeValue(row.col+1);
         }
     }
     sqlEnd(&row);
+    if (b && !found) bloomFalsePositive(b);
+    if (cache && value) memkvFill(cache,key,value,sdslen(value),expire,gen);
     return value;
 }
 
+/* Start a transaction, unless the caller is already inside one. Returns
+ * 1 if the transaction was started, so that kvTxEnd() knows if it should
+ * terminate it. */
+static int kvTxBegin(sqlite3 *dbhandle) {
+    sqlPool *pool = sqlPoolOf(dbhandle);
+    int intx = pool ? SqlTxPool == pool : !sqlite3_get_autocommit(dbhandle);
+    if (intx) return 0;
+    return sqlQuery(dbhandle,"BEGIN");
+}
+
+/* Commit (or rollback, if 'ok' is false) the transaction started by
+ * kvTxBegin(), if any. */
+static void kvTxEnd(sqlite3 *dbhandle, int started, int ok) {
+    if (!started) return;
+    sqlQuery(dbhandle,ok ? "COMMIT" : "ROLLBACK");
+}
+
+/* Set 'count' keys at once, in a single transaction, with the same expire
+ * time. If 'vlens' is NULL, the values length is obtained via strlen().
+ * Return 1 on success, or 0 on error (in such case no key is set, unless
+ * the caller has its own transaction in progress). */
+int kvMSet(sqlite3 *dbhandle, const char **keys, const char **values, const size_t *vlens, int count, int64_t expire) {
+    int started = kvTxBegin(dbhandle), ok = 1;
+    for (int j = 0; j < count && ok; j++) {
+        size_t vlen = vlens ? vlens[j] : strlen(values[j]);
+        ok = kvSetLen(dbhandle,keys[j],values[j],vlen,expire);
+    }
+    kvTxEnd(dbhandle,started,ok);
+    return ok;
+}
+
+/* Get 'count' keys at once, performing a single query (or a few, if there
+ * are many keys) for all the keys not found in the cache. Return an array
+ * of 'count' SDS strings, with NULL for keys that don't exist or are
+ * expired. The array should be freed with sdsfreesplitres(). */
+#define KV_MGET_CHUNK 256   /* Max keys per query. */
+sds *kvMGet(sqlite3 *dbhandle, const char **keys, int count) {
+    sqlPool *pool = sqlPoolOf(dbhandle);
+    memkv *cache = kvCacheOf(pool);
+    if (pool && SqlTxPool == pool) cache = NULL; /* See kvGet(). */
+    bloom *b = kvBloomOf(pool);
+    sds *values = xmalloc(sizeof(sds)*(count ? count : 1));
+    uint64_t *gens = xmalloc(sizeof(uint64_t)*(count ? count : 1));
+    sqlArg args[KV_MGET_CHUNK];
+    int missing[KV_MGET_CHUNK];
+    int64_t now = time(NULL);
+
+    for (int j = 0; j < count; j++)
+        values[j] = cache ? memkvGet(cache,keys[j],gens+j) : NULL;
+
+    int j = 0;
+    while(j < count) {
+        /* Collect the next chunk of keys not found in the cache. */
+        int nargs = 0;
+        sds query = sdsnew("SELECT key,expire,value FROM KeyValue "
+                           "WHERE key IN (");
+        for (; j < count && nargs < KV_MGET_CHUNK; j++) {
+            if (values[j] || (b && !bloomMaybe(b,keys[j]))) continue;
+            missing[nargs] = j;
+            args[nargs++] = sqlArgStr(keys[j]);
+            query = sdscat(query,nargs == 1 ? "?" : ",?");
+        }
+        query = sdscat(query,")");
+
+        sqlRow row;
+        if (nargs) sqlSelectArgv(dbhandle,&row,query,args,nargs);
+        while(nargs && sqlNextRow(&row)) {
+            int64_t expire = row.col[1].i;
+            if (expire && expire < now) continue;
+            /* The same key may be requested multiple times. */
+            for (int i = 0; i < nargs; i++) {
+                int idx = missing[i];
+                if (values[idx] ||
+                    (size_t)row.col[0].i != strlen(keys[idx]) ||
+                    memcmp(row.col[0].s,keys[idx],row.col[0].i)) continue;
+                values[idx] = kvDecodeValue(row.col+2);
+                if (cache && values[idx]) memkvFill(cache,keys[idx],values[idx],
+                                     sdslen(values[idx]),expire,gens[idx]);
+            }
+        }
+        for (int i = 0; b && i < nargs; i++)
+            if (values[missing[i]] == NULL) bloomFalsePositive(b);
+        sdsfree(query);
+    }
+    xfree(gens);
+    return values;
+}
+
 /* Delete the key if it exists. */
 void kvDel(sqlite3 *dbhandle, const char *key) {
-    sqlQuery(dbhandle,"DELETE FROM KeyValue WHERE key=?s",key);
+    sqlPool *pool = sqlPoolOf(dbhandle);
+    kvLockWriter(pool);
+    if (sqlQueryArgs(dbhandle,"DELETE FROM KeyValue WHERE key=?",key) &&
+        SqlLastChanges) kvBloomDeleted(pool,key);
+    kvCacheUpdate(pool,key,NULL,0,0);
+    kvUnlockWriter(pool);
+}
+
+/* Increment the integer stored at 'key' by 'delta', and return the new
+ * value. If the key does not exist, or is expired, it is created with
+ * 'delta' as value and 'expire' seconds of time to live (zero means no
+ * expire), otherwise the time to live of the existing key is retained:
+ * this way a counter like "messages in the last hour" can be implemented
+ * just calling kvIncrBy(db,key,1,3600).
+ *
+ * The whole read-modify-write is a single UPSERT statement, so concurrent
+ * callers can't lose updates, and the counter is stored as an INTEGER.
+ * Values that are not numbers are considered zero.
+ *
+ * If 'retval' is not NULL, it is set by reference to 1 on success, or 0
+ * on error (in such case zero is returned), since zero is also a valid
+ * value for a counter. */
+int64_t kvIncrBy(sqlite3 *dbhandle, const char *key, int64_t delta, int64_t expire, int *retval) {
+    sqlPool *pool = sqlPoolOf(dbhandle);
+    int64_t now = time(NULL), value = 0;
+    sqlRow row;
+
+    if (expire) expire += now;
+    kvLockWriter(pool);
+    int newkey = kvBloomAddNewKey(pool,key);
+    int rc = sqlSelectOneRowArgs(dbhandle,&row,
+        "INSERT INTO KeyValue VALUES(?1,?2,?3) ON CONFLICT(key) DO UPDATE "
+        "SET value=CASE WHEN expire > 0 AND expire < ?4 THEN excluded.value "
+                      "ELSE CAST(value AS INTEGER)+excluded.value END, "
+            "expire=CASE WHEN expire > 0 AND expire < ?4 THEN excluded.expire "
+                       "ELSE expire END "
+        "RETURNING expire,value",
+        expire,key,delta,now);
+    if (rc == SQLITE_ROW) {
+        char buf[32];
+        expire = row.col[0].i;
+        value = row.col[1].i;
+        int len = snprintf(buf,sizeof(buf),"%lld",(long long)value);
+        kvCacheUpdate(pool,key,buf,len,expire);
+    } else {
+        if (newkey) bloomRemove(kvBloomOf(pool),key);
+        kvCacheUpdate(pool,key,NULL,0,0);
+    }
+    sqlEnd(&row);
+    kvUnlockWriter(pool);
+    if (retval) *retval = rc == SQLITE_ROW;
+    return value;
+}
+
+/* Like kvIncrBy() but decrements the counter. */
+int64_t kvDecrBy(sqlite3 *dbhandle, const char *key, int64_t delta, int64_t expire, int *retval) {
+    return kvIncrBy(dbhandle,key,-delta,expire,retval);
+}
+
+/* Buffered counters. For very hot counters (for instance a global count
+ * of the processed messages) even a single write per increment may be too
+ * much: kvIncrByBuffered() just accumulates the delta in memory, and
+ * kvFlushCounters(), called periodically, writes all the accumulated
+ * deltas with a single transaction per database, one kvIncrBy() for each
+ * counter. The price to pay is that the increments performed after the
+ * last flush are lost if the process crashes, and that kvGet() does not
+ * see them until they are flushed: so the loss window is bounded by the
+ * flush period, KV_COUNTERS_FLUSH_MS, when the bot calls the flush function
+ * from its main loop. */
+#define KV_COUNTERS_FLUSH_MS 1000
+#define KV_COUNTERS_BUCKETS 1024
+
+typedef struct kvCounter {
+    sqlPool *pool;
+    sds key;
+    int64_t delta;
+    int64_t expire;             /* Relative, as passed to kvIncrBy(). */
+    struct kvCounter *next;
+} kvCounter;
+
+static pthread_mutex_t KvCountersLock = PTHREAD_MUTEX_INITIALIZER;
+static kvCounter *KvCounters[KV_COUNTERS_BUCKETS];
+static int KvNumCounters = 0;
+static uint64_t KvCountersLastFlush = 0;
+
+static unsigned int kvCounterBucket(sqlPool *pool, const char *key) {
+    uint64_t h = 14695981039346656037ULL ^ (uintptr_t)pool;
+    while(*key) {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211ULL;
+    }
+    return h % KV_COUNTERS_BUCKETS;
+}
+
+/* Add 'delta' to the buffered counter 'key'. The 'expire' is used only if
+ * the key gets created by the flush, exactly like in kvIncrBy(). Buffering
+ * requires the database connections pool: without it the increment is
+ * performed immediately. */
+void kvIncrByBuffered(sqlite3 *dbhandle, const char *key, int64_t delta, int64_t expire) {
+    sqlPool *pool = sqlPoolOf(dbhandle);
+    if (pool == NULL) {
+        kvIncrBy(dbhandle,key,delta,expire,NULL);
+        return;
+    }
+
+    unsigned int idx = kvCounterBucket(pool,key);
+    pthread_mutex_lock(&KvCountersLock);
+    kvCounter *c = KvCounters[idx];
+    while(c && (c->pool != pool || strcmp(c->key,key))) c = c->next;
+    if (c == NULL) {
+        c = xmalloc(sizeof(*c));
+        c->pool = pool;
+        c->key = sdsnew(key);
+        c->delta = 0;
+        c->next = KvCounters[idx];
+        KvCounters[idx] = c;
+        KvNumCounters++;
+    }
+    c->delta += delta;
+    c->expire = expire;
+    pthread_mutex_unlock(&KvCountersLock);
+}
+
+/* Write the buffered counters to the database. Unless 'force' is true,
+ * nothing is done if less than KV_COUNTERS_FLUSH_MS milliseconds elapsed
+ * since the last flush. Returns the number of counters written. */
+int kvFlushCounters(int force) {
+    uint64_t now = sqlProfUstime()/1000;
+    kvCounter *list = NULL;
+    int flushed = 0;
+
+    /* Detach all the counters while holding the lock, so that the other
+     * threads can continue incrementing while we write to the database. */
+    pthread_mutex_lock(&KvCountersLock);
+    if (!force && now-KvCountersLastFlush < KV_COUNTERS_FLUSH_MS) {
+        pthread_mutex_unlock(&KvCountersLock);
+        return 0;
+    }
+    KvCountersLastFlush = now;
+    for (int j = 0; j < KV_COUNTERS_BUCKETS && KvNumCounters; j++) {
+        while(KvCounters[j]) {
+            kvCounter *c = KvCounters[j];
+            KvCounters[j] = c->next;
+            c->next = list;
+            list = c;
+            KvNumCounters--;
+        }
+    }
+    pthread_mutex_unlock(&KvCountersLock);
+
+    /* Write the counters of every pool in a single transaction. */
+    while(list) {
+        sqlPool *pool = list->pool;
+        int started = kvTxBegin(pool->writer);
+        kvCounter **ref = &list;
+        while(*ref) {
+            kvCounter *c = *ref;
+            if (c->pool != pool) {
+                ref = &c->next;
+                continue;
+            }
+            if (c->delta) kvIncrBy(pool->writer,c->key,c->delta,c->expire,NULL);
+            *ref = c->next;
+            sdsfree(c->key);
+            xfree(c);
+            flushed++;
+        }
+        kvTxEnd(pool->writer,started,1);
+    }
+    return flushed;
+}
+
+/* Active expire of the KV store keys, in the style of the Redis active
+ * expire cycle. Expired keys are otherwise only deleted when kvGet()
+ * accesses them, so keys that are never read again would remain in the
+ * database forever. Every cycle deletes the expired keys in batches of
+ * KV_EXPIRE_BATCH, found range scanning the 'expire' index, so that every
+ * batch costs the same regardless of how many keys there are. Like Redis,
+ * we look at the fraction of keys that were found expired, not at their
+ * absolute number: a batch is compared with a sample of KV_EXPIRE_BATCH
+ * keys having an expire (or all of them, if they are fewer), and if the
+ * expired ones are more than KV_EXPIRE_STALE_PERC percent, many keys are
+ * likely still to expire, so we go on, until the time budget is reached
+ * (and in such case the next cycle runs immediately). Otherwise the
+ * interval between cycles starts from the minimum and doubles at every
+ * cycle, up to KV_EXPIRE_MAX_INTERVAL, so that a database where few keys
+ * expire is rarely scanned. */
+#define KV_EXPIRE_BATCH 200             /* Keys deleted per query. */
+#define KV_EXPIRE_STALE_PERC 10         /* Expired % to go on. */
+#define KV_EXPIRE_BUDGET_MS 25          /* Max duration of a cycle. */
+#define KV_EXPIRE_MIN_INTERVAL 1000     /* Milliseconds. */
+#define KV_EXPIRE_MAX_INTERVAL 16000    /* Milliseconds. */
+
+/* Should be called periodically (the bot calls it from the main loop)
+ * passing a state structure, initialized to zero, associated with the
+ * database. Returns the number of keys deleted. */
+int kvExpireCycle(sqlite3 *dbhandle, kvExpireState *state) {
+    uint64_t start = sqlProfUstime()/1000;
+    int deleted = 0, stale = 0;
+
+    if (start < state->next_cycle) return 0;
+
+    /* Not all the bots use the KV store: check that the table exists,
+     * otherwise we would log a query error at every cycle. */
+    if (!state->has_table) {
+        state->has_table = sqlSelectIntArgs(dbhandle,
+            "SELECT COUNT(*) FROM sqlite_master WHERE type=? AND name=?",
+            "table","KeyValue");
+        if (!state->has_table) {
+            state->next_cycle = start+KV_EXPIRE_MAX_INTERVAL;
+            return 0;
+        }
+    }
+
+    /* Number of keys with an expire, counted on the index without
+     * holding the writer lock. */
+    int64_t volatile_keys = sqlSelectInt(dbhandle,
+        "SELECT COUNT(*) FROM KeyValue WHERE expire > 0");
+
+    sqlPool *pool = sqlPoolOf(dbhandle);
+    while(volatile_keys > 0) {
+        sqlRow row;
+        int batch = 0;
+
+        /* The deleted keys are returned, so that they can be removed from
+         * the keys filter. */
+        kvLockWriter(pool);
+        int rc = sqlSelectArgs(dbhandle,&row,
+            "DELETE FROM KeyValue WHERE rowid IN "
+            "(SELECT rowid FROM KeyValue WHERE expire > 0 AND expire < ? "
+            "LIMIT ?) RETURNING key",(int64_t)time(NULL),KV_EXPIRE_BATCH);
+        while(sqlNextRowLazy(&row)) {
+            sqlCol *c = sqlColumn(&row,0);
+            if (c->type == SQLITE_TEXT) kvBloomDeleted(pool,c->s);
+            batch++;
+        }
+        kvUnlockWriter(pool);
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) break;
+
+        int64_t sample = volatile_keys < KV_EXPIRE_BATCH ?
+                         volatile_keys : KV_EXPIRE_BATCH;
+        stale = batch*100 > sample*KV_EXPIRE_STALE_PERC;
+        deleted += batch;
+        volatile_keys -= batch;
+        if (!stale || sqlProfUstime()/1000-start >= KV_EXPIRE_BUDGET_MS)
+            break;
+    }
+
+    if (stale && volatile_keys > 0) {
+        /* Stopped because of the time budget: go on ASAP. */
+        state->interval = 0;
+    } else if (state->interval == 0) {
+        state->interval = KV_EXPIRE_MIN_INTERVAL;
+    } else {
+        state->interval *= 2;
+        if (state->interval > KV_EXPIRE_MAX_INTERVAL)
+            state->interval = KV_EXPIRE_MAX_INTERVAL;
+    }
+    state->next_cycle = sqlProfUstime()/1000+state->interval;
+    state->expired += deleted;
+    state->cycles++;
+    return deleted;
+}
+
+/* Iterate the keys of the KV store starting with 'prefix' (an empty prefix
+ * matches all the keys), 'count' keys at a time, in lexicographical order.
+ * Every call is a range scan of the key index starting right after the
+ * last key returned by the previous call, so a cron job can walk millions
+ * of keys in small slices, without holding a read transaction (and thus
+ * preventing the WAL checkpoints) for the whole iteration. Keys added or
+ * removed during the iteration may or may not be returned.
+ *
+ * The 'cursor' is an SDS string passed by reference: it should be set to
+ * NULL to start the iteration, and it is updated at every call, and set
+ * back to NULL (freeing it) when there are no more keys:
+ *
+ *  sds cursor = NULL;
+ *  do {
+ *      int numkeys;
+ *      sds *keys = kvScan(db,"user:",&cursor,100,NULL,&numkeys);
+ *      ... process the keys ...
+ *      sdsfreesplitres(keys,numkeys);
+ *  } while(cursor);
+ *
+ * The keys are returned as an array of SDS strings, with the number of
+ * keys set by reference in 'numkeys'. If 'values' is not NULL, the array
+ * of the corresponding values is returned by reference as well. Both
+ * should be freed with sdsfreesplitres(). Expired keys are skipped, so a
+ * call may return fewer than 'count' keys (even zero) before the end of
+ * the iteration. */
+sds *kvScan(sqlite3 *dbhandle, const char *prefix, sds *cursor, int count, sds **values, int *numkeys) {
+    sds *keys = NULL, last = NULL;
+    int64_t now = time(NULL);
+    int scanned = 0, len = 0;
+    sqlRow row;
+
+    if (values) *values = NULL;
+    *numkeys = 0;
+    if (count <= 0) count = 1;
+
+    /* The keys having the prefix are the ones >= prefix and < the prefix
+     * with the last byte incremented (trailing 0xff bytes are removed
+     * first, since they can't be incremented). If nothing remains, the
+     * range has no upper bound. */
+    sds end = sdsnew(prefix);
+    while(sdslen(end) && (unsigned char)end[sdslen(end)-1] == 0xff)
+        sdsrange(end,0,-2);
+    if (sdslen(end)) end[sdslen(end)-1]++;
+
+    const char *start = *cursor ? *cursor : prefix;
+    sqlArg args[] = {sqlArgStr(start), sqlArgInt(count), sqlArgStr(end)};
+    const char *sql;
+    if (*cursor)
+        sql = sdslen(end) ?
+            "SELECT key,expire,value FROM KeyValue WHERE key > ? "
+            "AND key < ?3 ORDER BY key LIMIT ?2" :
+            "SELECT key,expire,value FROM KeyValue WHERE key > ? "
+            "ORDER BY key LIMIT ?2";
+    else
+        sql = sdslen(end) ?
+            "SELECT key,expire,value FROM KeyValue WHERE key >= ? "
+            "AND key < ?3 ORDER BY key LIMIT ?2" :
+            "SELECT key,expire,value FROM KeyValue WHERE key >= ? "
+            "ORDER BY key LIMIT ?2";
+    sqlSelectArgv(dbhandle,&row,sql,args,sdslen(end) ? 3 : 2);
+    while(sqlNextRow(&row)) {
+        scanned++;
+        sdsfree(last);
+        last = kvValueFromCol(row.col);
+        int64_t expire = row.col[1].i;
+        if (expire && expire < now) continue;
+        keys = xrealloc(keys,sizeof(sds)*(len+1));
+        keys[len] = sdsdup(last);
+        if (values) {
+            *values = xrealloc(*values,sizeof(sds)*(len+1));
+            (*values)[len] = kvDecodeValue(row.col+2);
+        }
+        len++;
+    }
+    sdsfree(end);
+
+    /* Fewer rows than requested means the range is exhausted. */
+    sdsfree(*cursor);
+    if (scanned < count) {
+        sdsfree(last);
+        *cursor = NULL;
+    } else {
+        *cursor = last;
+    }
+    *numkeys = len;
+    return keys;
+}
+
+/* Return the statistics of the KV cache of the database the connection
+ * belongs to, as an SDS string the caller should free. If the cache is
+ * disabled, an empty string is returned. */
+sds kvCacheInfo(sqlite3 *dbhandle) {
+    memkv *cache = kvCacheOf(sqlPoolOf(dbhandle));
+    sds info = sdsempty();
+    if (cache) info = memkvInfo(cache,info);
+    return info;
+}
+
+/* ============================================================================
+ * Hashes, lists and sorted sets on top of the KV store.
+ *
+ * These are the Redis data types most useful to a bot: hashes for per user
+ * records, lists for queues, sorted sets for leaderboards. Each type is
+ * stored in its own table (see TB_CREATE_KV_STORE), one row per element
+ * and indexed by key, so that changing a field or pushing an element
+ * touches a single row instead of rewriting a serialized blob. The three
+ * types have their own keys namespace, separated from the one of kvSet(),
+ * and their keys don't expire. The KV cache is not used for these types.
+ * ==========================================================================*/
+
+/* Return the score column as a double. Scores are stored in a REAL
+ * column, but SQLite may return integral values as integers (this
+ * happens for instance with RETURNING). */
+static double kvColDouble(sqlCol *c) {
+    return c->type == SQLITE_INTEGER ? (double)c->i : c->d;
+}
+
+/* Collect the first column of all the rows as an array of SDS strings
+ * (and, if 'scores' is not NULL, the second column as an array of
+ * doubles). The number of elements is returned by reference in 'count'.
+ * The returned array should be freed with sdsfreesplitres(), and the
+ * scores array with xfree(). If the array would be empty, NULL is
+ * returned. */
+static sds *kvCollectRows(sqlRow *row, double **scores, int *count) {
+    sds *res = NULL;
+    int len = 0;
+
+    if (scores) *scores = NULL;
+    while(sqlNextRow(row)) {
+        res = xrealloc(res,sizeof(sds)*(len+1));
+        res[len] = kvValueFromCol(row->col);
+        if (scores) {
+            *scores = xrealloc(*scores,sizeof(double)*(len+1));
+            (*scores)[len] = kvColDouble(row->col+1);
+        }
+        len++;
+    }
+    *count = len;
+    return res;
+}
+
+/* Turn the Redis style 'start' and 'stop' indexes, where negative indexes
+ * count from the tail (-1 is the last element), into an offset and a
+ * number of elements for the LIMIT clause. Returns 0 if the range is
+ * empty. */
+static int kvNormalizeRange(int64_t len, int64_t *start, int64_t *stop) {
+    if (*start < 0) *start += len;
+    if (*stop < 0) *stop += len;
+    if (*start < 0) *start = 0;
+    if (*stop >= len) *stop = len-1;
+    return *start <= *stop;
+}
+
+/* ------------------------------- Hashes --------------------------------- */
+
+/* Set the hash 'field' of 'key' to the specified value. Return 1 on
+ * success, 0 on error. */
+int kvHSetLen(sqlite3 *dbhandle, const char *key, const char *field, const char *value, size_t vlen) {
+    return sqlQueryArgs(dbhandle,
+        "INSERT INTO KeyHash VALUES(?,?,?) ON CONFLICT(key,field) "
+        "DO UPDATE SET value=excluded.value",
+        key,field,SQL_BLOB(value,vlen));
+}
+
+/* Wrapper where the value len is obtained via strlen(). */
+int kvHSet(sqlite3 *dbhandle, const char *key, const char *field, const char *value) {
+    return kvHSetLen(dbhandle,key,field,value,strlen(value));
+}
+
+/* Return the value of the hash field as an SDS string, or NULL if the
+ * field does not exist. */
+sds kvHGet(sqlite3 *dbhandle, const char *key, const char *field) {
+    sds value = NULL;
+    sqlRow row;
+    sqlSelectArgs(dbhandle,&row,
+        "SELECT value FROM KeyHash WHERE key=? AND field=?",key,field);
+    if (sqlNextRow(&row)) value = kvValueFromCol(row.col);
+    sqlEnd(&row);
+    return value;
+}
+
+/* Delete the hash field. Return 1 if the field existed, 0 otherwise. */
+int kvHDel(sqlite3 *dbhandle, const char *key, const char *field) {
+    if (!sqlQueryArgs(dbhandle,
+        "DELETE FROM KeyHash WHERE key=? AND field=?",key,field)) return 0;
+    return SqlLastChanges;
+}
+
+/* Increment the integer stored in the hash field by 'delta', creating
+ * the field if needed, and return the new value (zero on error). If
+ * 'retval' is not NULL, it is set to 1 on success or 0 on error, like
+ * in kvIncrBy(). */
+int64_t kvHIncrBy(sqlite3 *dbhandle, const char *key, const char *field, int64_t delta, int *retval) {
+    int64_t value = 0;
+    sqlRow row;
+    int rc = sqlSelectOneRowArgs(dbhandle,&row,
+        "INSERT INTO KeyHash VALUES(?,?,?) ON CONFLICT(key,field) "
+        "DO UPDATE SET value=CAST(value AS INTEGER)+excluded.value "
+        "RETURNING value",key,field,delta);
+    if (rc == SQLITE_ROW) value = row.col[0].i;
+    sqlEnd(&row);
+    if (retval) *retval = rc == SQLITE_ROW;
+    return value;
+}
+
+/* Return the number of fields of the hash. */
+int64_t kvHLen(sqlite3 *dbhandle, const char *key) {
+    return sqlSelectIntArgs(dbhandle,
+        "SELECT COUNT(*) FROM KeyHash WHERE key=?",key);
+}
+
+/* Return all the fields and values of the hash, as an array of SDS
+ * strings field1, value1, field2, value2, ... The number of array
+ * elements (twice the number of fields) is returned by reference in
+ * 'count'. The array should be freed with sdsfreesplitres(). If the hash
+ * does not exist NULL is returned and count is set to zero. */
+sds *kvHGetAll(sqlite3 *dbhandle, const char *key, int *count) {
+    sds *res = NULL;
+    int len = 0;
+    sqlRow row;
+
+    sqlSelectArgs(dbhandle,&row,
+        "SELECT field,value FROM KeyHash WHERE key=? ORDER BY field",key);
+    while(sqlNextRow(&row)) {
+        res = xrealloc(res,sizeof(sds)*(len+2));
+        res[len++] = kvValueFromCol(row.col);
+        res[len++] = kvValueFromCol(row.col+1);
+    }
+    *count = len;
+    return res;
+}
+
+/* -------------------------------- Lists --------------------------------- */
+
+/* Lists elements are rows having an integer position 'idx': pushing on
+ * the head uses the current minimum minus one, pushing on the tail the
+ * maximum plus one, so that both are a single insert statement, and both
+ * the lookup of the position and the pops are a seek in the (key,idx)
+ * index. */
+
+/* Push the value on the head (if 'tail' is 0) or on the tail of the list.
+ * Return 1 on success, 0 on error. */
+static int kvPush(sqlite3 *dbhandle, const char *key, const char *value, size_t vlen, int tail) {
+    return sqlQueryArgs(dbhandle, tail ?
+        "INSERT INTO KeyList SELECT ?1,COALESCE(MAX(idx),-1)+1,?2 "
+        "FROM KeyList WHERE key=?1" :
+        "INSERT INTO KeyList SELECT ?1,COALESCE(MIN(idx),1)-1,?2 "
+        "FROM KeyList WHERE key=?1",
+        key,SQL_BLOB(value,vlen));
+}
+
+int kvLPush(sqlite3 *dbhandle, const char *key, const char *value, size_t vlen) {
+    return kvPush(dbhandle,key,value,vlen,0);
+}
+
+int kvRPush(sqlite3 *dbhandle, const char *key, const char *value, size_t vlen) {
+    return kvPush(dbhandle,key,value,vlen,1);
+}
+
+/* Remove and return the head (if 'tail' is 0) or the tail element of the
+ * list, as an SDS string, or NULL if the list is empty. */
+static sds kvPop(sqlite3 *dbhandle, const char *key, int tail) {
+    sds value = NULL;
+    sqlRow row;
+    if (sqlSelectOneRowArgs(dbhandle,&row, tail ?
+        "DELETE FROM KeyList WHERE rowid=(SELECT rowid FROM KeyList "
+        "WHERE key=? ORDER BY idx DESC LIMIT 1) RETURNING value" :
+        "DELETE FROM KeyList WHERE rowid=(SELECT rowid FROM KeyList "
+        "WHERE key=? ORDER BY idx LIMIT 1) RETURNING value",
+        key) == SQLITE_ROW)
+    {
+        value = kvValueFromCol(row.col);
+    }
+    sqlEnd(&row);
+    return value;
+}
+
+sds kvLPop(sqlite3 *dbhandle, const char *key) {
+    return kvPop(dbhandle,key,0);
+}
+
+sds kvRPop(sqlite3 *dbhandle, const char *key) {
+    return kvPop(dbhandle,key,1);
+}
+
+/* Return the number of elements of the list. */
+int64_t kvLLen(sqlite3 *dbhandle, const char *key) {
+    return sqlSelectIntArgs(dbhandle,
+        "SELECT COUNT(*) FROM KeyList WHERE key=?",key);
+}
+
+/* Return the elements of the list from 'start' to 'stop' inclusive, as
+ * an array of SDS strings, with the same semantics of the Redis LRANGE
+ * command (negative indexes count from the tail). The number of elements
+ * is returned by reference in 'count'. The array should be freed with
+ * sdsfreesplitres(). */
+sds *kvLRange(sqlite3 *dbhandle, const char *key, int64_t start, int64_t stop, int *count) {
+    sqlRow row;
+    *count = 0;
+    if ((start < 0 || stop < 0) &&
+        !kvNormalizeRange(kvLLen(dbhandle,key),&start,&stop)) return NULL;
+    if (start < 0) start = 0;
+    if (start > stop) return NULL;
+    sqlSelectArgs(dbhandle,&row,
+        "SELECT value FROM KeyList WHERE key=? ORDER BY idx "
+        "LIMIT ? OFFSET ?",key,stop-start+1,start);
+    return kvCollectRows(&row,NULL,count);
+}
+
+/* ----------------------------- Sorted sets ------------------------------ */
+
+/* Add the member to the sorted set with the specified score, or update
+ * the score if the member already exists. Return 1 on success, 0 on
+ * error. */
+int kvZAdd(sqlite3 *dbhandle, const char *key, const char *member, double score) {
+    return sqlQueryArgs(dbhandle,
+        "INSERT INTO KeySortedSet VALUES(?,?,?) ON CONFLICT(key,member) "
+        "DO UPDATE SET score=excluded.score",
+        key,member,score);
+}
+
+/* Increment the score of the member by 'delta', adding it with 'delta' as
+ * score if it does not exist, and return the new score (zero on error).
+ * If 'retval' is not NULL, it is set to 1 on success or 0 on error, like
+ * in kvIncrBy(). */
+double kvZIncrBy(sqlite3 *dbhandle, const char *key, const char *member, double delta, int *retval) {
+    double score = 0;
+    sqlRow row;
+    int rc = sqlSelectOneRowArgs(dbhandle,&row,
+        "INSERT INTO KeySortedSet VALUES(?,?,?) ON CONFLICT(key,member) "
+        "DO UPDATE SET score=score+excluded.score RETURNING score",
+        key,member,delta);
+    if (rc == SQLITE_ROW) score = kvColDouble(row.col);
+    sqlEnd(&row);
+    if (retval) *retval = rc == SQLITE_ROW;
+    return score;
+}
+
+/* Remove the member. Return 1 if the member existed, 0 otherwise. */
+int kvZRem(sqlite3 *dbhandle, const char *key, const char *member) {
+    if (!sqlQueryArgs(dbhandle,
+        "DELETE FROM KeySortedSet WHERE key=? AND member=?",key,member))
+        return 0;
+    return SqlLastChanges;
+}
+
+/* Lookup the score of the member. Return 1 and set 'score' by reference
+ * if the member exists, otherwise 0 is returned. */
+int kvZScore(sqlite3 *dbhandle, const char *key, const char *member, double *score) {
+    int found = 0;
+    sqlRow row;
+    sqlSelectArgs(dbhandle,&row,
+        "SELECT score FROM KeySortedSet WHERE key=? AND member=?",
+        key,member);
+    if (sqlNextRow(&row)) {
+        *score = kvColDouble(row.col);
+        found = 1;
+    }
+    sqlEnd(&row);
+    return found;
+}
+
+/* Return the number of members of the sorted set. */
+int64_t kvZCard(sqlite3 *dbhandle, const char *key) {
+    return sqlSelectIntArgs(dbhandle,
+        "SELECT COUNT(*) FROM KeySortedSet WHERE key=?",key);
+}
+
+/* Return the rank (zero based position ordering by score, then member)
+ * of the member, or -1 if the member does not exist. If 'rev' is true the
+ * rank is computed from the highest score, like ZREVRANK. The elements
+ * before the member are counted via the (key,score,member) index. */
+int64_t kvZRank(sqlite3 *dbhandle, const char *key, const char *member, int rev) {
+    int64_t rank = -1;
+    sqlRow row;
+    sqlSelectArgs(dbhandle,&row, rev ?
+        "WITH m AS (SELECT score FROM KeySortedSet WHERE key=?1 AND member=?2) "
+        "SELECT (SELECT COUNT(*) FROM KeySortedSet, m WHERE key=?1 AND "
+        "(KeySortedSet.score > m.score OR "
+        "(KeySortedSet.score = m.score AND member > ?2))) FROM m" :
+        "WITH m AS (SELECT score FROM KeySortedSet WHERE key=?1 AND member=?2) "
+        "SELECT (SELECT COUNT(*) FROM KeySortedSet, m WHERE key=?1 AND "
+        "(KeySortedSet.score < m.score OR "
+        "(KeySortedSet.score = m.score AND member < ?2))) FROM m",
+        key,member);
+    if (sqlNextRow(&row)) rank = row.col[0].i;
+    sqlEnd(&row);
+    return rank;
+}
+
+/* Return the members from rank 'start' to rank 'stop' inclusive, as an
+ * array of SDS strings, with the same semantics of the Redis ZRANGE
+ * command (and of ZREVRANGE if 'rev' is true, that is what a leaderboard
+ * usually needs). If 'scores' is not NULL, an array with the scores of
+ * the returned members is returned by reference, to be freed with
+ * xfree(). The number of members is returned by reference in 'count',
+ * and the array should be freed with sdsfreesplitres(). */
+sds *kvZRange(sqlite3 *dbhandle, const char *key, int64_t start, int64_t stop, int rev, double **scores, int *count) {
+    sqlRow row;
+    *count = 0;
+    if (scores) *scores = NULL;
+    if ((start < 0 || stop < 0) &&
+        !kvNormalizeRange(kvZCard(dbhandle,key),&start,&stop)) return NULL;
+    if (start < 0) start = 0;
+    if (start > stop) return NULL;
+    sqlSelectArgs(dbhandle,&row, rev ?
+        "SELECT member,score FROM KeySortedSet WHERE key=? "
+        "ORDER BY score DESC, member DESC LIMIT ? OFFSET ?" :
+        "SELECT member,score FROM KeySortedSet WHERE key=? "
+        "ORDER BY score, member LIMIT ? OFFSET ?",
+        key,stop-start+1,start);
+    return kvCollectRows(&row,scores,count);
+}
+
+/* ============================================================================
+ * In memory KV namespace.
+ *
+ * Much of the state of a bot (rate limits, the current step of a
+ * conversation, keys used to avoid processing the same thing twice) does
+ * not need to survive a restart, so writing it to SQLite is a waste. The
+ * kvMem*() functions have the same semantics of kvSet(), kvGet() and
+ * kvDel(), but the keys live only in a process wide in memory table (see
+ * memkv.c), shared by all the threads, and separated from the keys of the
+ * database. Optionally the table can be saved on shutdown and loaded at
+ * startup with kvMemSave() and kvMemLoad(): the bot does it when started
+ * with --memfile.
+ * ==========================================================================*/
+
+#define KV_MEM_EXPIRE_BUCKETS 64    /* Buckets per stripe per cycle. */
+
+static memkv *KvMem = NULL;
+static pthread_once_t KvMemOnce = PTHREAD_ONCE_INIT;
+
+static void kvMemInit(void) {
+    KvMem = memkvCreate(0);
+}
+
+static memkv *kvMemTable(void) {
+    pthread_once(&KvMemOnce,kvMemInit);
+    return KvMem;
+}
+
+/* Set the key to the specified value. The expire is in seconds, like in
+ * kvSetLen(), and zero means no expire. */
+void kvMemSetLen(const char *key, const char *value, size_t vlen, int64_t expire) {
+    if (expire) expire += time(NULL);
+    memkvSet(kvMemTable(),key,value,vlen,expire);
+}
+
+void kvMemSet(const char *key, const char *value, int64_t expire) {
+    kvMemSetLen(key,value,strlen(value),expire);
+}
+
+/* Return the value of the key as an SDS string, or NULL if the key does
+ * not exist or is expired. */
+sds kvMemGet(const char *key) {
+    return memkvGet(kvMemTable(),key,NULL);
+}
+
+/* Delete the key. Return 1 if the key existed, 0 otherwise. */
+int kvMemDel(const char *key) {
+    return memkvDel(kvMemTable(),key);
+}
+
+/* Delete some of the expired keys: should be called periodically (the bot
+ * calls it from the main loop). Returns the number of deleted keys. */
+int kvMemExpireCycle(void) {
+    return memkvExpire(kvMemTable(),KV_MEM_EXPIRE_BUCKETS);
+}
+
+/* Save / load the in memory keys to / from the specified file. Both
+ * return 1 on success and 0 on error. */
+int kvMemSave(const char *filename) {
+    return memkvSave(kvMemTable(),filename);
+}
+
+int kvMemLoad(const char *filename) {
+    return memkvLoad(kvMemTable(),filename);
+}
+
+/* Return the statistics of the in memory namespace as an SDS string the
+ * caller should free. */
+sds kvMemInfo(void) {
+    return memkvInfo(kvMemTable(),sdsempty());
 }
@@ -2,8 +2,39 @@
 #define SQLITE_WRAPPER_H
 
 #include <stdint.h>
+#include <pthread.h>
 
 #define SQL_MAX_SPEC 32     /* Maximum number of ?... specifiers per query. */
+#define SQL_MAX_POOLS 64    /* Maximum number of connection pools. */
+
+/* A pool of connections to the same database file: many read only
+ * connections, and a single connection used for writes. */
+typedef struct sqlPool {
+    sds filename;               /* Database file, as reported by SQLite. */
+    sqlite3 *writer;            /* The connection used for all the writes. */
+    pthread_mutex_t writer_lock; /* Serializes the writer. Recursive. */
+    sqlite3 **readers;          /* Idle read only connections. */
+    int numreaders;             /* Number of idle read only connections. */
+    pthread_mutex_t readers_lock; /* Protects the idle connections list. */
+    struct memkv *kvcache;      /* KV store cache, or NULL if disabled. */
+    struct bloom *kvbloom;      /* KV store keys filter, or NULL. */
+} sqlPool;
+
+/* State of the KV store active expire, see kvExpireCycle(). */
+typedef struct kvExpireState {
+    int has_table;              /* True if the KeyValue table exists. */
+    uint64_t next_cycle;        /* Milliseconds time of the next cycle. */
+    uint64_t interval;          /* Current milliseconds between cycles. */
+    uint64_t expired;           /* Total number of keys expired. */
+    uint64_t cycles;            /* Total number of cycles performed. */
+} kvExpireState;
+
+/* Statistics about a completed online backup, see sqlBackup(). */
+typedef struct sqlBackupStats {
+    int pages;                  /* Number of pages copied. */
+    int64_t bytes;              /* Size of the copy. */
+    uint64_t duration_us;       /* Duration of the backup. */
+} sqlBackupStats;
 
 /* The sqlCol and sqlRow structures are used in order to return rows. */
 typedef struct sqlCol {
@@ -16,10 +47,116 @@ typedef struct sqlCol {
 typedef struct sqlRow {
     sqlite3_stmt *stmt; /* Handle for this query. */
     int cols;           /* Number of columns. */
-    sqlCol *col;        /* Array of columns. Note that the first time this
-                           will be NULL, so we now we don't need to call
-                           sqlite3_step() since it was called by the
-                           query function. */
+    sqlCol *col;        /* Array of columns, reused across rows. Note that
+                           the first time this will be NULL, so we now we
+                           don't need to call sqlite3_step() since it was
+                           called by the query function. */
+    sqlPool *locked;    /* If not NULL, the statement is executing on the
+                           writer of this pool, that is locked till
+                           sqlEnd() is called. */
 } sqlRow;
 
+/* Typed query argument. Arrays of sqlArg are bound, in order, to the "?"
+ * placeholders of the query by sqlGenericQueryArgv(). */
+typedef struct sqlArg {
+    int type;           /* SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT,
+                           SQLITE_BLOB or SQLITE_NULL. */
+    int64_t i;          /* Integer or len of blob. */
+    const char *s;      /* String or blob. */
+    double d;           /* Double. */
+} sqlArg;
+
+static inline sqlArg sqlArgInt(int64_t i) {
+    sqlArg a = {.type = SQLITE_INTEGER, .i = i};
+    return a;
+}
+
+/* Unsigned 64 bit values above INT64_MAX can't be stored by SQLite as
+ * integers: instead of wrapping them to negative numbers, the argument
+ * is marked as invalid, and the query fails with SQLITE_RANGE. */
+#define SQL_ARG_INVALID -1
+static inline sqlArg sqlArgUint(uint64_t u) {
+    sqlArg a = {.type = u > INT64_MAX ? SQL_ARG_INVALID : SQLITE_INTEGER,
+                .i = (int64_t)(u & INT64_MAX)};
+    return a;
+}
+
+static inline sqlArg sqlArgDouble(double d) {
+    sqlArg a = {.type = SQLITE_FLOAT, .d = d};
+    return a;
+}
+
+static inline sqlArg sqlArgStr(const char *s) {
+    sqlArg a = {.type = s ? SQLITE_TEXT : SQLITE_NULL, .s = s};
+    return a;
+}
+
+static inline sqlArg sqlArgSelf(sqlArg a) {
+    return a;
+}
+
+#define SQL_BLOB(ptr,len) \
+    ((sqlArg){.type = SQLITE_BLOB, .s = (const char*)(ptr), .i = (len)})
+#define SQL_NULL ((sqlArg){.type = SQLITE_NULL})
+
+/* Convert a C value into a sqlArg according to its type. There is no
+ * default case on purpose: passing a value of a type we don't know how to
+ * bind (a char, a struct, a pointer that is not a string, ...) is a
+ * compile time error instead of undefined behavior at runtime. Blobs
+ * must be passed as SQL_BLOB(ptr,len). */
+#define SQL_ARG(x) _Generic((x),                                    \
+    char*: sqlArgStr, const char*: sqlArgStr,                       \
+    float: sqlArgDouble, double: sqlArgDouble,                      \
+    _Bool: sqlArgInt,                                               \
+    short: sqlArgInt, unsigned short: sqlArgInt,                    \
+    int: sqlArgInt, unsigned int: sqlArgInt,                        \
+    long: sqlArgInt, unsigned long: sqlArgUint,                     \
+    long long: sqlArgInt, unsigned long long: sqlArgUint,           \
+    sqlArg: sqlArgSelf)(x)
+
+/* Apply SQL_ARG() to up to 16 arguments. */
+#define SQL_NARGS(...) SQL_NARGS_(__VA_ARGS__,16,15,14,13,12,11,10,9,8,7,6,5,4,3,2,1)
+#define SQL_NARGS_(_1,_2,_3,_4,_5,_6,_7,_8,_9,_10,_11,_12,_13,_14,_15,_16,N,...) N
+#define SQL_CAT(a,b) SQL_CAT_(a,b)
+#define SQL_CAT_(a,b) a##b
+#define SQL_MAP_1(a) SQL_ARG(a)
+#define SQL_MAP_2(a,...) SQL_ARG(a),SQL_MAP_1(__VA_ARGS__)
+#define SQL_MAP_3(a,...) SQL_ARG(a),SQL_MAP_2(__VA_ARGS__)
+#define SQL_MAP_4(a,...) SQL_ARG(a),SQL_MAP_3(__VA_ARGS__)
+#define SQL_MAP_5(a,...) SQL_ARG(a),SQL_MAP_4(__VA_ARGS__)
+#define SQL_MAP_6(a,...) SQL_ARG(a),SQL_MAP_5(__VA_ARGS__)
+#define SQL_MAP_7(a,...) SQL_ARG(a),SQL_MAP_6(__VA_ARGS__)
+#define SQL_MAP_8(a,...) SQL_ARG(a),SQL_MAP_7(__VA_ARGS__)
+#define SQL_MAP_9(a,...) SQL_ARG(a),SQL_MAP_8(__VA_ARGS__)
+#define SQL_MAP_10(a,...) SQL_ARG(a),SQL_MAP_9(__VA_ARGS__)
+#define SQL_MAP_11(a,...) SQL_ARG(a),SQL_MAP_10(__VA_ARGS__)
+#define SQL_MAP_12(a,...) SQL_ARG(a),SQL_MAP_11(__VA_ARGS__)
+#define SQL_MAP_13(a,...) SQL_ARG(a),SQL_MAP_12(__VA_ARGS__)
+#define SQL_MAP_14(a,...) SQL_ARG(a),SQL_MAP_13(__VA_ARGS__)
+#define SQL_MAP_15(a,...) SQL_ARG(a),SQL_MAP_14(__VA_ARGS__)
+#define SQL_MAP_16(a,...) SQL_ARG(a),SQL_MAP_15(__VA_ARGS__)
+#define SQL_ARGV(...) \
+    (const sqlArg[]){SQL_CAT(SQL_MAP_,SQL_NARGS(__VA_ARGS__))(__VA_ARGS__)}, \
+    SQL_NARGS(__VA_ARGS__)
+
+/* Typed versions of sqlInsert(), sqlQuery() and so forth. The query uses
+ * the plain SQLite "?" placeholders, and the arguments are converted at
+ * compile time into an array of sqlArg, so no format string is parsed
+ * at runtime and the argument types are checked by the compiler:
+ *
+ *  sqlQueryArgs(db,"UPDATE KeyValue SET expire=?,value=? WHERE key=?",
+ *               expire,SQL_BLOB(ptr,len),key);
+ *
+ * At least one and at most 16 arguments can be passed. For queries without
+ * arguments use the non typed functions, for more than 16 arguments
+ * call the *Argv() functions directly. */
+#define sqlInsertArgs(db,sql,...) sqlInsertArgv(db,sql,SQL_ARGV(__VA_ARGS__))
+#define sqlQueryArgs(db,sql,...) sqlQueryArgv(db,sql,SQL_ARGV(__VA_ARGS__))
+#define sqlSelectArgs(db,row,sql,...) \
+    sqlSelectArgv(db,row,sql,SQL_ARGV(__VA_ARGS__))
+#define sqlSelectOneRowArgs(db,row,sql,...) \
+    sqlSelectOneRowArgv(db,row,sql,SQL_ARGV(__VA_ARGS__))
+#define sqlSelectIntArgs(db,sql,...) \
+    sqlSelectIntArgv(db,sql,SQL_ARGV(__VA_ARGS__))
+
 #endif